@@ -11,6 +11,7 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdbool.h>
+#include <sys/mman.h>
 #include "../checksum_implementations/xxh32.h"
 #include "../checksum_implementations/crc32.h"
 
@@ -18,6 +19,16 @@
 #define XXH32_SEED 0xFF32
 #define HEAP_CAPACITY (65536) // 64KB heap size
 #define SPLIT_THRESHOLD (16)
+#ifndef LARGE_OBJECT_THRESHOLD
+#define LARGE_OBJECT_THRESHOLD (16384) // allocations of at least this size get a mapping of their own
+#endif
+#define LARGE_PAGE_SIZE (4096)
+
+#if defined(__linux__) && !defined(MREMAP_MAYMOVE)
+/* Only declared by <sys/mman.h> under _GNU_SOURCE, which must be set before any system header */
+#define MREMAP_MAYMOVE (1)
+extern void *mremap(void *old_address, size_t old_size, size_t new_size, int flags, ...);
+#endif
 
 /* Alignment options */
 typedef enum
@@ -32,6 +43,9 @@ typedef enum
 #define DEFAULT_ALIGNMENT (ALIGN_8)
 #define MAX_ALIGNMENT (ALIGN_32)
 #define DEBUG_LOGGING (1)
+#ifndef SIZED_FREE_CHECK
+#define SIZED_FREE_CHECK (0) // verify heap_free_sized against the full pointer search
+#endif
 
 /* Public API declarations */
 bool heap_init(void);
@@ -40,6 +54,9 @@ void *heap_realloc(void *ptr, size_t new_size, alignment_t new_alignment);
 void heap_free(void *ptr);
 void heap_get_stats(size_t *total_size, size_t *used_size,
                     size_t *free_size, size_t *largest_free_block);
+size_t heap_alloc_batch(size_t size, alignment_t alignment, void **out, size_t n);
+size_t heap_free_batch(void **ptrs, size_t n);
+void heap_free_sized(void *ptr, size_t size, alignment_t alignment);
 
 #ifdef MEM_IMPLEMENTATION
 
@@ -55,13 +72,26 @@ typedef struct __attribute__((packed))
                                      sizeof(uint32_t) + sizeof(uint8_t) + sizeof(void *))];
 } metadata_t;
 
+/* Header of a large object mapping; the chunk metadata directly precedes the data as in the heap */
+typedef struct large_object_t
+{
+    struct large_object_t *prev;
+    struct large_object_t *next;
+    size_t mapped_size;
+    uint8_t padding[MAX_ALIGNMENT - 3 * sizeof(void *)];
+    metadata_t chunk;
+} large_object_t;
+
 /* Static assertions */
 _Static_assert(sizeof(metadata_t) == MAX_ALIGNMENT,
                "Metadata size must match MAX_ALIGNMENT");
+_Static_assert(sizeof(large_object_t) % MAX_ALIGNMENT == 0,
+               "Large object header must keep the data aligned");
 
 /* Internal state */
 static uint8_t heap[HEAP_CAPACITY] __attribute__((aligned(MAX_ALIGNMENT))) = {0};
 static bool is_initialized = false;
+static large_object_t *large_objects = NULL;
 
 /* Heap navigation macros */
 #define HEAP_START ((uint8_t *)heap)
@@ -175,6 +205,130 @@ static void *split_chunk_if_possible(metadata_t *chunk, size_t required_size)
     return CHUNK_DATA(chunk);
 }
 
+/* Large object functions */
+static void *large_alloc(size_t size)
+{
+    size_t mapped_size = align_up(sizeof(large_object_t) + size, LARGE_PAGE_SIZE);
+    large_object_t *object = mmap(NULL, mapped_size, PROT_READ | PROT_WRITE,
+                                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (object == MAP_FAILED)
+    {
+        if (DEBUG_LOGGING)
+        {
+            printf("Allocation failed: Could not map %zu bytes\n", size);
+        }
+        return NULL;
+    }
+
+    object->mapped_size = mapped_size;
+    object->chunk.chunk_size = mapped_size - sizeof(large_object_t);
+    object->chunk.prev_chunk = NULL;
+    object->chunk.is_allocated = true;
+    object->chunk.current_alignment = MAX_ALIGNMENT;
+    object->chunk.checksum = calculate_chunk_checksum(&object->chunk);
+
+    object->prev = NULL;
+    object->next = large_objects;
+    if (large_objects)
+    {
+        large_objects->prev = object;
+    }
+    large_objects = object;
+
+    if (DEBUG_LOGGING)
+    {
+        printf("Mapped large object of %zu bytes at %p\n", size, (void *)CHUNK_DATA(&object->chunk));
+    }
+    return CHUNK_DATA(&object->chunk);
+}
+
+static large_object_t *find_large_object(void *ptr)
+{
+    for (large_object_t *object = large_objects; object; object = object->next)
+    {
+        if (CHUNK_DATA(&object->chunk) == ptr)
+        {
+            return calculate_chunk_checksum(&object->chunk) == object->chunk.checksum ? object : NULL;
+        }
+    }
+    return NULL;
+}
+
+static void relink_large_object(large_object_t *object)
+{
+    if (object->prev)
+    {
+        object->prev->next = object;
+    }
+    else
+    {
+        large_objects = object;
+    }
+    if (object->next)
+    {
+        object->next->prev = object;
+    }
+}
+
+static void large_free(large_object_t *object)
+{
+    if (object->prev)
+    {
+        object->prev->next = object->next;
+    }
+    else
+    {
+        large_objects = object->next;
+    }
+    if (object->next)
+    {
+        object->next->prev = object->prev;
+    }
+
+    if (DEBUG_LOGGING)
+    {
+        printf("Unmapped large object at %p (size: %zu)\n",
+               (void *)CHUNK_DATA(&object->chunk), object->chunk.chunk_size);
+    }
+    munmap(object, object->mapped_size);
+}
+
+/* Resizes with mremap, which moves pages instead of copying them */
+static void *large_realloc(large_object_t *object, size_t new_size)
+{
+    size_t mapped_size = align_up(sizeof(large_object_t) + new_size, LARGE_PAGE_SIZE);
+    if (mapped_size == object->mapped_size)
+    {
+        return CHUNK_DATA(&object->chunk);
+    }
+
+#ifdef MREMAP_MAYMOVE
+    large_object_t *moved = mremap(object, object->mapped_size, mapped_size, MREMAP_MAYMOVE);
+#else
+    large_object_t *moved = mmap(NULL, mapped_size, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (moved != MAP_FAILED)
+    {
+        memcpy(moved, object, mapped_size < object->mapped_size ? mapped_size : object->mapped_size);
+        munmap(object, object->mapped_size);
+    }
+#endif
+    if (moved == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    moved->mapped_size = mapped_size;
+    moved->chunk.chunk_size = mapped_size - sizeof(large_object_t);
+    moved->chunk.checksum = calculate_chunk_checksum(&moved->chunk);
+    relink_large_object(moved);
+    return CHUNK_DATA(&moved->chunk);
+}
+
+static void *allocate_from(metadata_t **cursor, size_t size, alignment_t alignment);
+static bool free_pointer(void *ptr);
+static void free_chunk(metadata_t *chunk);
+
 /* Public function implementations */
 bool heap_init(void)
 {
@@ -207,7 +361,7 @@ bool heap_init(void)
 
 void *heap_alloc(size_t size, alignment_t alignment)
 {
-    if (size == 0 || size > HEAP_CAPACITY || !is_initialized)
+    if (size == 0 || !is_initialized)
     {
         return NULL;
     }
@@ -217,7 +371,20 @@ void *heap_alloc(size_t size, alignment_t alignment)
         alignment = DEFAULT_ALIGNMENT;
     }
 
-    metadata_t *current = (metadata_t *)HEAP_START;
+    // mappings are page aligned, which covers every alignment_t
+    if (size >= LARGE_OBJECT_THRESHOLD)
+    {
+        return large_alloc(size);
+    }
+
+    metadata_t *cursor = (metadata_t *)HEAP_START;
+    return allocate_from(&cursor, size, alignment);
+}
+
+/* First fit starting at *cursor, which is left just past the allocated chunk */
+static void *allocate_from(metadata_t **cursor, size_t size, alignment_t alignment)
+{
+    metadata_t *current = *cursor;
     while (is_within_heap(current))
     {
         if (!validate_chunk(current))
@@ -259,6 +426,7 @@ void *heap_alloc(size_t size, alignment_t alignment)
                     printf("Allocated %zu bytes at %p (aligned to %d)\n",
                            size, result, alignment);
                 }
+                *cursor = (metadata_t *)NEXT_CHUNK(current);
                 return result;
             }
         }
@@ -285,15 +453,49 @@ void *heap_realloc(void *ptr, size_t new_size, alignment_t new_alignment)
         return NULL;
     }
 
+    if (new_alignment > MAX_ALIGNMENT || (new_alignment & (new_alignment - 1)))
+    {
+        new_alignment = DEFAULT_ALIGNMENT;
+    }
+
+    if (!is_within_heap(ptr))
+    {
+        large_object_t *object = find_large_object(ptr);
+        if (!object)
+        {
+            return NULL;
+        }
+
+        if (new_size >= LARGE_OBJECT_THRESHOLD)
+        {
+            return large_realloc(object, new_size);
+        }
+
+        void *new_ptr = heap_alloc(new_size, new_alignment);
+        if (new_ptr)
+        {
+            memcpy(new_ptr, ptr, new_size);
+            large_free(object);
+        }
+        return new_ptr;
+    }
+
     metadata_t *chunk = find_chunk_for_pointer(ptr);
     if (!chunk)
     {
         return NULL;
     }
 
-    if (new_alignment > MAX_ALIGNMENT || (new_alignment & (new_alignment - 1)))
+    // Large sizes always move out to their own mapping
+    if (new_size >= LARGE_OBJECT_THRESHOLD)
     {
-        new_alignment = DEFAULT_ALIGNMENT;
+        void *new_ptr = heap_alloc(new_size, new_alignment);
+        if (new_ptr)
+        {
+            memcpy(new_ptr, ptr, chunk->chunk_size);
+            heap_free(ptr);
+        }
+        return new_ptr;
     }
 
     // Try to shrink or expand in place
@@ -327,10 +529,30 @@ void *heap_realloc(void *ptr, size_t new_size, alignment_t new_alignment)
 }
 
 void heap_free(void *ptr)
+{
+    free_pointer(ptr);
+}
+
+static bool free_pointer(void *ptr)
 {
     if (!ptr || !is_initialized)
     {
-        return;
+        return false;
+    }
+
+    if (!is_within_heap(ptr))
+    {
+        large_object_t *object = find_large_object(ptr);
+        if (object)
+        {
+            large_free(object);
+            return true;
+        }
+        if (DEBUG_LOGGING)
+        {
+            printf("Warning: Could not find valid metadata for pointer %p\n", ptr);
+        }
+        return false;
     }
 
     metadata_t *chunk = find_chunk_for_pointer(ptr);
@@ -340,21 +562,104 @@ void heap_free(void *ptr)
         {
             printf("Warning: Could not find valid metadata for pointer %p\n", ptr);
         }
-        return;
+        return false;
     }
 
+    free_chunk(chunk);
+    return true;
+}
+
+static void free_chunk(metadata_t *chunk)
+{
     chunk->is_allocated = false;
     chunk->current_alignment = calculate_alignment(chunk);
     chunk->checksum = calculate_chunk_checksum(chunk);
 
     if (DEBUG_LOGGING)
     {
-        printf("Freed chunk at %p (size: %zu)\n", ptr, chunk->chunk_size);
+        printf("Freed chunk at %p (size: %zu)\n", (void *)CHUNK_DATA(chunk), chunk->chunk_size);
     }
 
     try_coalesce_with_next(chunk);
 }
 
+/* Uses the allocation size to go straight to the metadata instead of searching for it */
+void heap_free_sized(void *ptr, size_t size, alignment_t alignment)
+{
+    if (!ptr || !is_initialized)
+    {
+        return;
+    }
+
+    if (size >= LARGE_OBJECT_THRESHOLD)
+    {
+        large_object_t *object = (large_object_t *)((uint8_t *)ptr - sizeof(large_object_t));
+        if (SIZED_FREE_CHECK && object != find_large_object(ptr))
+        {
+            printf("Warning: %p is not a large object of %zu bytes\n", ptr, size);
+            return;
+        }
+        large_free(object);
+        return;
+    }
+
+    // heap_alloc hands out the data directly after the chunk metadata
+    metadata_t *chunk = (metadata_t *)((uint8_t *)ptr - sizeof(metadata_t));
+    if (!validate_chunk(chunk) || !chunk->is_allocated || chunk->chunk_size < size)
+    {
+        free_pointer(ptr);
+        return;
+    }
+
+    if (SIZED_FREE_CHECK && (chunk != find_chunk_for_pointer(ptr) || (alignment && ((uintptr_t)ptr & (alignment - 1)))))
+    {
+        printf("Warning: %p was not allocated with size %zu and alignment %d\n", ptr, size, alignment);
+        return;
+    }
+    free_chunk(chunk);
+}
+
+/* Resumes the first-fit scan after each allocation instead of restarting at the heap start */
+size_t heap_alloc_batch(size_t size, alignment_t alignment, void **out, size_t n)
+{
+    if (size == 0 || !out || !is_initialized)
+    {
+        return 0;
+    }
+
+    if ((alignment & (alignment - 1)) != 0 || alignment > MAX_ALIGNMENT)
+    {
+        alignment = DEFAULT_ALIGNMENT;
+    }
+
+    size_t served = 0;
+    if (size >= LARGE_OBJECT_THRESHOLD)
+    {
+        while (served < n && (out[served] = large_alloc(size)))
+        {
+            served++;
+        }
+        return served;
+    }
+
+    metadata_t *cursor = (metadata_t *)HEAP_START;
+    while (served < n && (out[served] = allocate_from(&cursor, size, alignment)))
+    {
+        served++;
+    }
+    return served;
+}
+
+size_t heap_free_batch(void **ptrs, size_t n)
+{
+    size_t freed = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        freed += free_pointer(ptrs[i]);
+    }
+    return freed;
+}
+
 void heap_get_stats(size_t *total_size, size_t *used_size,
                     size_t *free_size, size_t *largest_free_block)
 {
@@ -380,6 +685,12 @@ void heap_get_stats(size_t *total_size, size_t *used_size,
         }
         current = (metadata_t *)NEXT_CHUNK(current);
     }
+
+    for (large_object_t *object = large_objects; object; object = object->next)
+    {
+        *total_size += object->chunk.chunk_size;
+        *used_size += object->chunk.chunk_size;
+    }
 }
 
 #endif // MEM_IMPLEMENTATION
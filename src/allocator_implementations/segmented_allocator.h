@@ -3,14 +3,46 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
 #include <stdio.h>
+#include <sys/mman.h>
+#include <sched.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <semaphore.h>
+#include <errno.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#if defined(__linux__) && !defined(MREMAP_MAYMOVE)
+// only declared by <sys/mman.h> under _GNU_SOURCE, which must be set before any system header
+#define MREMAP_MAYMOVE (1)
+extern void *mremap(void *old_address, size_t old_size, size_t new_size, int flags, ...);
+#endif
+
+#if defined(__linux__) && !defined(__USE_GNU)
+// likewise only declared by <pthread.h> under _GNU_SOURCE
+extern int pthread_getattr_np(pthread_t thread, pthread_attr_t *attr);
+#endif
+
+#define HEAP_SEGMENT_SIZE (1 << 20)       // the heap grows by mapping segments of at least this size
+#ifndef LARGE_OBJECT_THRESHOLD
+#define LARGE_OBJECT_THRESHOLD (1 << 18)  // allocations of at least this size get a mapping of their own
+#endif
+#define ARENA_CHUNK_SIZE (1 << 16)        // default bytes an arena takes from the heap at a time
+#define HEAP_PAGE_SHIFT (12)
+#define HEAP_PAGE_SIZE (1 << HEAP_PAGE_SHIFT) // segments are mapped in multiples of this
+#define CHUNK_POOL_GROWTH (4096)              // heap chunk metadata nodes mapped at a time
+#define CHUNK_HEADER_SIZE (sizeof(metadata_t *)) // every heap allocation is preceded by a pointer to its metadata
 
-#define HEAP_CAPACITY (65536)
-#define FREE_CAPACITY (1024)
-#define ALLOC_CAPACITY (1024)
+// two level radix tree from page number to owning segment, covering a 48 bit address space
+#define PAGE_MAP_ADDRESS_BITS (48)
+#define PAGE_MAP_LEAF_BITS (18)
+#define PAGE_MAP_ROOT_BITS (PAGE_MAP_ADDRESS_BITS - HEAP_PAGE_SHIFT - PAGE_MAP_LEAF_BITS)
 
 #define MAX_ALIGNMENT (ALIGN_64)
 #define MAX_ALIGNMENT_INT (64)
@@ -18,21 +50,91 @@
 
 #define SPLIT_CUTOFF (16)
 
+// 0 merges a freed heap chunk with its free neighbours immediately; 1 only files it and
+// merges the whole heap every FREE_DEFRAG_CUTOFF frees
+#ifndef DEFERRED_COALESCING
+#define DEFERRED_COALESCING (0)
+#endif
 #define FREE_DEFRAG_CUTOFF (32) // must be a power of 2
 
-#define BIN_8_SIZE (8)
-#define BIN_16_SIZE (16)
-#define BIN_32_SIZE (32)
-#define BIN_8_CAPACITY (1024)
-#define BIN_16_CAPACITY (512)
-#define BIN_32_CAPACITY (256)
+// 1 makes heap_free_sized verify the caller's size against a full pointer lookup
+#ifndef SIZED_FREE_CHECK
+#define SIZED_FREE_CHECK (0)
+#endif
+
+// two-level segregated fit index over free heap chunks
+#define TLSF_SL_LOG2 (5) // second-level lists per power of two, as a log2
+#define TLSF_SL_COUNT (1 << TLSF_SL_LOG2)
+#define TLSF_GRANULE_LOG2 (3) // heap chunk sizes are multiples of 8 bytes
+#define TLSF_FL_SHIFT (TLSF_SL_LOG2 + TLSF_GRANULE_LOG2)
+#define TLSF_SMALL_BLOCK (1 << TLSF_FL_SHIFT) // below this, lists are linear in size
+#define TLSF_FL_MAX (40)                      // chunks must be smaller than 2^TLSF_FL_MAX
+#define TLSF_FL_COUNT (TLSF_FL_MAX - TLSF_FL_SHIFT + 1)
+
+// size classes served from bins as X(slot size, slots per slab); slot sizes must ascend in multiples
+// of 8 and slab capacities must be multiples of 64. Spaced four classes per doubling past 64 bytes,
+// like jemalloc, so a slot wastes at most 25% of its size; everything above the last class uses the heap
+#define SIZE_CLASSES(X)                                    \
+    X(8, 1024) X(16, 512) X(32, 256) X(48, 256) X(64, 256) \
+    X(80, 256) X(96, 256) X(112, 256) X(128, 256)          \
+    X(160, 128) X(192, 128) X(224, 128) X(256, 128)        \
+    X(320, 128) X(384, 128) X(448, 128) X(512, 128)        \
+    X(640, 64) X(768, 64) X(896, 64) X(1024, 64)           \
+    X(1280, 64) X(1536, 64) X(1792, 64) X(2048, 64)        \
+    X(2560, 64) X(3072, 64) X(3584, 64) X(4096, 64)
+#define SIZE_CLASS_MAX (4096) // must match the last class
+
+#define SIZE_CLASS_ONE(size, capacity) +1
+#define SIZE_CLASS_INVALID(size, capacity) | ((capacity) % 64) | ((size) % 8)
+#define SIZE_CLASS_ALIGNMENT(size) (((size) & -(size)) < MAX_ALIGNMENT_INT ? ((size) & -(size)) : MAX_ALIGNMENT_INT)
+#define SIZE_CLASS_BIN(size, capacity) {size, capacity, (alignment_t)SIZE_CLASS_ALIGNMENT(size), NULL, NULL},
+
+#define BIN_COUNT (0 SIZE_CLASSES(SIZE_CLASS_ONE))
+#define TCACHE_CAPACITY (64) // slots a thread may hold per bin before flushing back
+#define TCACHE_BATCH (32)    // slots moved between a thread cache and the shared bins at once
+
+#ifndef GC_LAZY_SWEEP
+#define GC_LAZY_SWEEP (0) // 1 defers sweeping heap segments and slabs until allocation needs them, or gc_sweep_step
+#endif
+#ifndef GC_GENERATIONAL
+#define GC_GENERATIONAL (0) // 1 keeps survivors marked as old, so most collections only trace young objects
+#endif
+#define GC_FULL_INTERVAL (8) // with GC_GENERATIONAL, every this many collections is a full one
+#ifndef GC_CONCURRENT
+#define GC_CONCURRENT (0) // 1 makes gc_collect hand a full cycle to a background thread that marks alongside the mutators
+#endif
+#define GC_CONCURRENT_SLICE (1 << 20) // bytes the background collector marks between yields to the mutators
+#define GC_CONCURRENT_HEADROOM (25)   // percent of the pacing trigger allocated in a background cycle before assists
+#define GC_CARD_SHIFT (9)    // gc_write_barrier dirties cards of this many bytes, as a log2
+#ifndef GC_MARK_THREADS
+#define GC_MARK_THREADS (4) // threads marking in parallel, the collecting thread included
+#endif
+#ifndef GC_DEQUE_CAPACITY
+#define GC_DEQUE_CAPACITY (1 << 20) // grey ranges each marker can queue, mapped lazily; on overflow the heap is rescanned
+#endif
+#define GC_MARK_CHUNK (1024)        // words scanned per work item, longer ranges are split so they can be stolen
+#define GC_ASSIST_WORK (1 << 16)    // bytes an allocation that leaves the thread cache marks while an incremental cycle runs
+#ifndef GC_PACING_RATIO
+#define GC_PACING_RATIO (100) // collect once this many percent of the live heap has been allocated since, 0 never does
+#endif
+#define GC_PACING_MIN (4 << 20) // bytes allocated before a paced collection, however small the live heap
+#ifndef GC_INTERIOR_POINTERS
+#define GC_INTERIOR_POINTERS (1) // 1 lets a pointer anywhere inside an allocation keep it alive, 0 only one to its start
+#endif
+#ifndef GC_SUSPEND_SIGNAL
+#if defined(__linux__)
+#define GC_SUSPEND_SIGNAL (SIGPWR) // stops a registered thread for a collection
+#define GC_RESUME_SIGNAL (SIGXCPU) // lets it run again
+#else
+#define GC_SUSPEND_SIGNAL (SIGUSR1)
+#define GC_RESUME_SIGNAL (SIGUSR2)
+#endif
+#endif
 
 typedef enum
 {
     ALLOC_TYPE_HEAP,
-    ALLOC_TYPE_BIN_8,
-    ALLOC_TYPE_BIN_16,
-    ALLOC_TYPE_BIN_32
+    ALLOC_TYPE_BIN
 } allocation_type_t;
 
 typedef enum
@@ -49,70 +151,248 @@ typedef enum
     ALIGN_SAME = 0,
 } alignment_t;
 
-typedef struct
+// layout of the objects gc_alloc_typed makes: an allocation is an array of size byte elements, and bit i of
+// pointers is set when word i of every element may hold a pointer; the descriptor must outlive the objects
+typedef struct gc_type_t
+{
+    size_t size; // a multiple of sizeof(void *)
+    const uint64_t *pointers;
+} gc_type_t;
+
+#define GC_POINTER_BIT(type, member) (1ULL << (offsetof(type, member) / sizeof(void *)))
+
+typedef struct metadata_t
 {
     void *chunk_ptr;
     void *data_ptr;
-    void *prev_chunk_ptr;
+    struct metadata_t *prev_phys; // address-adjacent chunks in the same segment
+    struct metadata_t *next_phys;
+    struct metadata_t *prev_free; // links within a TLSF free list, or the unused chunk list
+    struct metadata_t *next_free;
     size_t size;
     size_t usable_size;
     alignment_t current_alignment;
     allocation_type_t alloc_type;
-    bool mark;
+    const gc_type_t *gc_type; // NULL unless allocated through gc_alloc_typed or gc_alloc_atomic
+    bool is_free;
 } metadata_t;
 
-static metadata_t free_array[FREE_CAPACITY] = {0};
-static metadata_t alloc_array[ALLOC_CAPACITY] = {0};
-static size_t free_array_size = 0;
-static size_t alloc_array_size = 0;
+typedef enum
+{
+    SEGMENT_HEAP,
+    SEGMENT_SLAB,
+    SEGMENT_CHUNK_POOL,
+    SEGMENT_LARGE // a single allocation starting at memory
+} segment_kind_t;
+
+struct bin_t;
 
-static uint8_t heap[HEAP_CAPACITY] __attribute__((aligned(MAX_ALIGNMENT_INT))) = {0};
+// header at the start of every mapping the allocator owns
+typedef struct segment_t
+{
+    uint8_t *memory; // first usable byte, MAX_ALIGNMENT aligned
+    size_t size;     // usable bytes starting at memory
+    size_t mapped_size;
+    segment_kind_t kind;
+    struct segment_t *prev; // every segment, most recently mapped first
+    struct segment_t *next;
+    metadata_t *first_chunk; // heap segments: lowest chunk in the segment
+    bool mark;               // large objects: reached by the collector
+    const gc_type_t *gc_type; // large objects: as for heap chunks
+    uint64_t *marks;         // heap segments: one bit per TLSF granule, set at the start of each reached chunk; slabs: one per slot
+    uint64_t *starts;        // heap segments with GC_INTERIOR_POINTERS: one bit per TLSF granule, see record_chunk_start
+    uint64_t *start_words;   // likewise: one bit per word of starts, set while that word holds a start bit
+    bool unswept;            // marked by the last collection but not swept yet
+    bool dirty;              // written through gc_write_barrier since the last collection
+    uint8_t *cards;          // heap segments and slabs with GC_GENERATIONAL: one byte per card, set when it is written
+    struct segment_t *next_unswept;
+
+    // slabs only: slot_size-sized slots with one bit per slot in used, marks, typed and atomic;
+    // a typed slot keeps its gc_type_t in its last word
+    struct bin_t *bin;
+    size_t slot_size;
+    size_t capacity;
+    size_t used_count;
+    size_t first_free_word; // no free slot exists in the words before this one
+    struct segment_t *prev_partial; // slabs of the same bin that still have free slots
+    struct segment_t *next_partial;
+    uint64_t *used;
+    uint64_t *typed;
+    uint64_t *atomic;
+} segment_t;
+
+typedef struct bin_t
+{
+    size_t slot_size;
+    size_t slab_capacity;
+    alignment_t alignment; // the largest alignment the class serves, slabs start MAX_ALIGNMENT aligned
+    segment_t *partial_slabs;
+    segment_t *unswept_slabs; // may still hold slabs that were swept since, they are skipped
+} bin_t;
+
+_Static_assert(!(0 SIZE_CLASSES(SIZE_CLASS_INVALID)),
+               "Size classes must be multiples of 8 and fill whole bitmap words");
+_Static_assert(BIN_COUNT < 256, "Size class indices must fit the lookup table");
+_Static_assert(LARGE_OBJECT_THRESHOLD > SIZE_CLASS_MAX, "Large objects must be larger than every size class");
+
+static bin_t bins[BIN_COUNT] = {SIZE_CLASSES(SIZE_CLASS_BIN)};
+
+// smallest class for each 8 byte step of size, per log2 of the alignment, whose slots are aligned enough
+static uint8_t size_class_lookup[7][(SIZE_CLASS_MAX >> 3) + 1];
+
+// filled in under heap_lock but read without it; leaves and entries are published with release stores
+static segment_t ***page_map = NULL;
+static segment_t *segment_list = NULL;
+static uintptr_t segment_span_low = UINTPTR_MAX; // every segment holding allocations lies between these, read
+static uintptr_t segment_span_high = 0;          // without the lock by the collector to filter candidate pointers
+
+static metadata_t *unused_chunks = NULL;
+
+static uint64_t tlsf_fl_bitmap = 0;
+static uint32_t tlsf_sl_bitmap[TLSF_FL_COUNT] = {0};
+static metadata_t *tlsf_free_lists[TLSF_FL_COUNT][TLSF_SL_COUNT] = {0};
+
+#define ALIGN_UP(n, align) (((n) + (align) - 1) & ~(size_t)((align) - 1))
+#define SEGMENT_HEADER_SIZE ALIGN_UP(sizeof(segment_t), MAX_ALIGNMENT_INT) // large objects start this far into their mapping
+#define PAGE_MAP_ROOT(addr) ((uintptr_t)(addr) >> (HEAP_PAGE_SHIFT + PAGE_MAP_LEAF_BITS))
+#define PAGE_MAP_LEAF(addr) (((uintptr_t)(addr) >> HEAP_PAGE_SHIFT) & ((1 << PAGE_MAP_LEAF_BITS) - 1))
+#define BIN_SLOT(slab, ptr) ((size_t)((uint8_t *)(ptr) - (slab)->memory) / (slab)->slot_size)
+#define HEAP_MARK_BIT(segment, chunk) ((size_t)((uint8_t *)(chunk)->chunk_ptr - (segment)->memory) >> TLSF_GRANULE_LOG2)
+#define HEAP_MARK_WORDS(size) (ALIGN_UP((size) >> TLSF_GRANULE_LOG2, 64) / 64)
+#define CARD_COUNT(size) (GC_GENERATIONAL ? ((size) + (1 << GC_CARD_SHIFT) - 1) >> GC_CARD_SHIFT : 0)
+#define CARD_INDEX(segment, addr) ((size_t)((uint8_t *)(addr) - (segment)->memory) >> GC_CARD_SHIFT)
+
+#define BITMAP_TEST(map, i) ((map)[(i) >> 6] & (1ULL << ((i) & 63)))
+#define BITMAP_SET(map, i) ((map)[(i) >> 6] |= (1ULL << ((i) & 63)))
+#define BITMAP_CLEAR(map, i) ((map)[(i) >> 6] &= ~(1ULL << ((i) & 63)))
+
+// arena memory is bump allocated out of chunks that are ordinary heap allocations
+typedef struct arena_chunk_t
+{
+    struct arena_chunk_t *next;
+    uint8_t *top; // next free byte
+    uint8_t *end;
+} arena_chunk_t;
 
-static uint8_t bin_8[BIN_8_CAPACITY * BIN_8_SIZE] __attribute__((aligned(MAX_ALIGNMENT_INT))) = {0};
-static uint8_t bin_16[BIN_16_CAPACITY * BIN_16_SIZE] __attribute__((aligned(MAX_ALIGNMENT_INT))) = {0};
-static uint8_t bin_32[BIN_32_CAPACITY * BIN_32_SIZE] __attribute__((aligned(MAX_ALIGNMENT_INT))) = {0};
+typedef struct heap_arena_t
+{
+    arena_chunk_t *head;
+    arena_chunk_t *current; // chunks after this one are left over from before the last reset
+    size_t chunk_size;
+    struct heap_arena_t *prev; // every live arena, so the collector can keep their chunks alive
+    struct heap_arena_t *next;
+} heap_arena_t;
 
-static metadata_t free_bin_8[BIN_8_CAPACITY] = {0};
-static metadata_t alloc_bin_8[BIN_8_CAPACITY] = {0};
-static metadata_t free_bin_16[BIN_16_CAPACITY] = {0};
-static metadata_t alloc_bin_16[BIN_16_CAPACITY] = {0};
-static metadata_t free_bin_32[BIN_32_CAPACITY] = {0};
-static metadata_t alloc_bin_32[BIN_32_CAPACITY] = {0};
+#define ARENA_CHUNK_HEADER_SIZE ALIGN_UP(sizeof(arena_chunk_t), MAX_ALIGNMENT_INT)
+#define ARENA_CHUNK_DATA(chunk) ((uint8_t *)(chunk) + ARENA_CHUNK_HEADER_SIZE)
 
-static size_t free_bin_8_size = 0;
-static size_t alloc_bin_8_size = 0;
-static size_t free_bin_16_size = 0;
-static size_t alloc_bin_16_size = 0;
-static size_t free_bin_32_size = 0;
-static size_t alloc_bin_32_size = 0;
+static heap_arena_t *arena_list = NULL;
 
 static size_t num_of_free_called_on_heap = 0;
 
+// guards every shared structure above; the thread caches below are the only lock-free path
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct tcache_t
+{
+    void *slots[BIN_COUNT][TCACHE_CAPACITY];
+    size_t count[BIN_COUNT];
+    struct tcache_t *next;
+    bool registered;
+} tcache_t;
+
+static __thread tcache_t tcache = {0};
+static tcache_t *tcache_list = NULL; // every live thread cache, so the GC can see slots parked in them
+static pthread_key_t tcache_key;
+static uintptr_t tcache_cookie = 0; // written into the first word of a cached slot, so a second free is noticed
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+
+static bool gc_kinds_used = false; // set once a typed or atomic object exists, so frees have kind bits to clear
+static const gc_type_t gc_atomic_type = {sizeof(void *), NULL}; // the layout of every gc_alloc_atomic object
+static bool gc_marking = false; // an incremental cycle has taken its root snapshot and is not finished, see gc_step
+static size_t gc_allocated_bytes = 0; // taken from the bins and the heap since the last collection
+
 void *heap_alloc(size_t size, alignment_t alignment);
 void heap_free(void *ptr);
 void heap_init();
 void *heap_realloc(void *ptr, size_t new_size, alignment_t new_alignment);
+void heap_get_stats(size_t *total_size, size_t *used_size,
+                    size_t *free_size, size_t *largest_free_block);
+size_t heap_alloc_batch(size_t size, alignment_t alignment, void **out, size_t n);
+size_t heap_free_batch(void **ptrs, size_t n);
+void heap_free_sized(void *ptr, size_t size, alignment_t alignment);
+heap_arena_t *heap_arena_create(size_t chunk_size);
+void *heap_arena_alloc(heap_arena_t *arena, size_t size, alignment_t alignment);
+void heap_arena_reset(heap_arena_t *arena);
+void heap_arena_destroy(heap_arena_t *arena);
+
+#ifdef GC_COLLECT
+void gc_register_root(void *root);
+void gc_register_thread();
+void gc_unregister_thread();
+void gc_collect();
+void gc_collect_full();
+bool gc_sweep_step(size_t budget);
+void gc_card_mark(void *slot, void *value);
+void gc_write(void **slot, void *value);
+bool gc_step(size_t max_work);
+bool gc_get_progress(size_t *scanned_bytes, size_t *pending_bytes);
+size_t gc_set_pacing(size_t ratio);
+bool gc_register_root_range(void *start, size_t size);
+void gc_unregister_root_range(void *start);
+bool gc_exclude_range(void *start, size_t size);
+void *gc_alloc_typed(size_t size, alignment_t alignment, const gc_type_t *type);
+void *gc_alloc_atomic(size_t size, alignment_t alignment);
+
+// stores value into the pointer slot of a heap object; with GC_GENERATIONAL or GC_CONCURRENT, or while gc_step
+// runs a cycle, every such store must use it
+#define gc_write_barrier(slot, value) ((void)sizeof(*(slot) = (value)), gc_write((void **)(slot), (void *)(value)))
+#endif
 
 #define MEM_IMPLEMENTATION
 
 #ifdef MEM_IMPLEMENTATION
 
-static void init_bins();
-static ssize_t search_by_ptr(void *ptr, metadata_t *array, size_t array_size);
-static ssize_t search_by_ptr_in_free_array(void *ptr);
-static ssize_t search_by_ptr_in_alloc_array(void *ptr);
-static ssize_t search_by_size_in_free_array(size_t size, alignment_t alignment);
 static inline alignment_t calculate_alignment(const void *ptr);
-static bool remove_from_array(size_t index, metadata_t *array, size_t *array_size);
-static bool remove_from_free_array(size_t index);
-static bool remove_from_alloc_array(size_t index);
-static size_t find_insertion_position(void *data_ptr, metadata_t *array, size_t array_size);
-static bool add_into_array(metadata_t chunk, metadata_t *array, size_t *array_size, size_t capacity);
-static bool add_into_free_array(void *chunk_ptr, void *data_ptr, void *prev_chunk_ptr,
-                                size_t size, size_t usable_size, alignment_t alignment);
-static bool add_into_alloc_array(void *chunk_ptr, void *data_ptr, void *prev_chunk_ptr,
-                                 size_t size, size_t usable_size, alignment_t alignment);
+static segment_t *map_segment(segment_kind_t kind, size_t header_size, size_t usable_size);
+static bool register_segment(segment_t *segment);
+static void unregister_segment(segment_t *segment);
+static inline segment_t *segment_for_ptr(const void *ptr);
+static metadata_t *new_chunk(void *chunk_ptr, size_t size);
+static void release_chunk(metadata_t *chunk);
+static inline void tlsf_mapping(size_t size, size_t *fl, size_t *sl);
+static inline size_t tlsf_round_up(size_t size);
+static void tlsf_insert(metadata_t *chunk);
+static void tlsf_remove(metadata_t *chunk);
+static metadata_t *tlsf_find(size_t size);
+static metadata_t *split_chunk(metadata_t *chunk, size_t size);
+static metadata_t *grow_heap(size_t size);
+static metadata_t *coalesce_chunk(metadata_t *chunk);
 static void defragment_heap();
+static inline size_t size_class_for(size_t size, alignment_t alignment);
+static bool slab_slot(segment_t *slab, void *ptr, size_t *slot);
+static segment_t *slab_for_ptr(void *ptr, size_t *slot);
+static void link_partial_slab(segment_t *slab);
+static void unlink_partial_slab(segment_t *slab);
+static metadata_t *find_allocation(segment_t *segment, void *ptr);
+static size_t bin_alloc_slots(bin_t *bin, void **slots, size_t count);
+static bool bin_free_slot(segment_t *slab, size_t slot);
+static metadata_t *heap_find_chunk(size_t size);
+static void *heap_alloc_chunk(size_t size, alignment_t alignment);
+static void heap_free_chunk(metadata_t *chunk);
+static void *large_alloc(size_t size);
+static void large_free(segment_t *segment);
+static void *large_realloc(segment_t *segment, size_t new_size);
+static bool sized_free_matches(void *ptr, size_t size, alignment_t alignment);
+static arena_chunk_t *arena_add_chunk(heap_arena_t *arena, size_t size);
+static bool resize_chunk(metadata_t *chunk, size_t size);
+static void tcache_register();
+static void *tcache_alloc(size_t bin);
+static void tcache_free(void *ptr, size_t bin);
+static bool tcache_holds(void *ptr, size_t bin);
+static void *alloc_once(size_t size, alignment_t alignment);
+static void *alloc_typed(size_t size, alignment_t alignment, const gc_type_t *type);
+static inline const gc_type_t *slab_slot_type(segment_t *slab, size_t slot);
 
 #ifdef GC_COLLECT
 
@@ -123,6 +403,97 @@ extern char __bss_start, _end;    // bss section boundaries
 static void *gc_roots[MAX_GC_ROOTS];
 static size_t gc_roots_count = 0;
 
+// a thread whose stack and registers are scanned, see gc_register_thread
+typedef struct gc_thread_t
+{
+    pthread_t thread;
+    void *stack_top;     // highest address of the stack
+    void *stack_pointer; // where the thread's live stack starts while it is stopped, NULL otherwise
+    bool registered;
+    volatile sig_atomic_t in_barrier;       // a collection must not stop the thread halfway through a barrier
+    volatile sig_atomic_t suspend_deferred; // so it stops itself once the barrier is done
+    struct gc_thread_t *prev;
+    struct gc_thread_t *next;
+} gc_thread_t;
+
+static __thread gc_thread_t gc_thread = {0};
+static gc_thread_t *gc_thread_list = NULL;
+static pthread_mutex_t gc_thread_lock = PTHREAD_MUTEX_INITIALIZER; // held for a whole collection, so the list is stable
+static pthread_key_t gc_thread_key;
+static pthread_once_t gc_thread_once = PTHREAD_ONCE_INIT;
+static sem_t gc_thread_ack; // posted by a thread once it has stopped, and again once it has resumed
+static bool gc_world_stopped = false;
+static segment_t *unswept_heap = NULL; // heap segments left for lazy sweeping, may hold some swept since
+static size_t gc_collections = 0;
+static size_t gc_incremental_cycles = 0;     // incremental cycles started so far, the running one is the last
+static __thread size_t gc_stepped_cycle = 0; // the cycle this thread's gc_step calls drive, 0 before the first
+
+// a range of words still to be scanned
+typedef struct
+{
+    void **start;
+    void **end;
+    const gc_type_t *type; // NULL scans every word, otherwise start is the first word of an element
+} mark_range_t;
+
+// each marker pushes and pops grey ranges at the bottom of its own deque, idle markers steal from the top
+typedef struct
+{
+    pthread_mutex_t lock;
+    mark_range_t *items;
+    size_t capacity;
+    size_t top;
+    size_t bottom;
+    size_t marked_bytes; // by this marker in the running collection
+} mark_deque_t;
+
+static mark_deque_t mark_deques[GC_MARK_THREADS];
+static size_t gc_markers = 1; // the collecting thread plus the pool threads that started
+static size_t gc_idle_markers = 0;
+static size_t gc_finished_markers = 0;
+static size_t gc_cycle = 0;
+static pthread_mutex_t gc_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gc_cycle_started = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t gc_cycle_finished = PTHREAD_COND_INITIALIZER;
+static pthread_once_t gc_pool_once = PTHREAD_ONCE_INIT;
+static bool gc_mark_overflowed = false; // some marked objects could not be queued and still need scanning
+static bool gc_snapshot_roots = false;  // root ranges are scanned on the spot rather than queued
+static size_t gc_scanned_words = 0;     // by the steps of the running incremental cycle
+static pthread_once_t gc_collector_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t gc_collector_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gc_collector_wake = PTHREAD_COND_INITIALIZER;
+static bool gc_collector_running = false;  // with GC_CONCURRENT, the background collector thread exists
+static bool gc_collect_requested = false; // and gc_collect asked it for a cycle
+static size_t gc_pacing_ratio = GC_PACING_RATIO;
+static size_t gc_live_bytes = 0;                                   // marked by the last collection
+static size_t gc_pacing_trigger = GC_PACING_RATIO ? GC_PACING_MIN : 0; // gc_allocated_bytes that start the next one
+
+// word ranges scanned as roots, and ranges of the static data that are not; both guarded by gc_thread_lock
+#define MAX_GC_ROOT_RANGES 64
+typedef struct
+{
+    void **start;
+    void **end;
+} root_range_t;
+
+static root_range_t gc_root_ranges[MAX_GC_ROOT_RANGES];
+static size_t gc_root_ranges_count = 0;
+static root_range_t gc_excluded_ranges[MAX_GC_ROOT_RANGES] = {
+    // the allocator's own tables point at slabs, free chunks and roots, none of which they keep alive
+    {(void **)bins, (void **)(bins + BIN_COUNT)},
+    {(void **)size_class_lookup, (void **)(size_class_lookup + 7)},
+    {(void **)tlsf_sl_bitmap, (void **)(tlsf_sl_bitmap + TLSF_FL_COUNT)},
+    {(void **)tlsf_free_lists, (void **)(tlsf_free_lists + TLSF_FL_COUNT)},
+    {(void **)gc_roots, (void **)(gc_roots + MAX_GC_ROOTS)},
+    {(void **)mark_deques, (void **)(mark_deques + GC_MARK_THREADS)},
+    {(void **)gc_root_ranges, (void **)(gc_root_ranges + MAX_GC_ROOT_RANGES)},
+    {(void **)gc_excluded_ranges, (void **)(gc_excluded_ranges + MAX_GC_ROOT_RANGES)},
+};
+static size_t gc_excluded_ranges_count = 8;
+
+static void scan_range(size_t marker, void **start, void **end, const gc_type_t *type);
+static bool step(size_t max_work, bool start, size_t *cycle);
+
 void gc_register_root(void *root)
 {
     if (gc_roots_count < MAX_GC_ROOTS)
@@ -131,740 +502,2916 @@ void gc_register_root(void *root)
     }
 }
 
-static bool is_valid_heap_ptr(void *ptr)
+// only the words lying wholly inside a range are part of it
+static bool add_range(root_range_t *ranges, size_t *count, void *start, size_t size)
 {
+    void **first = (void **)ALIGN_UP((size_t)start, sizeof(void *));
+    void **end = (void **)(((size_t)start + size) & ~(sizeof(void *) - 1));
+
+    pthread_mutex_lock(&gc_thread_lock);
+    bool added = *count < MAX_GC_ROOT_RANGES;
+    if (added && first < end)
+    {
+        ranges[(*count)++] = (root_range_t){first, end};
+    }
+    pthread_mutex_unlock(&gc_thread_lock);
+
+    return added;
+}
 
-    return ((uintptr_t)ptr >= (uintptr_t)heap && (uintptr_t)ptr < (uintptr_t)heap + HEAP_CAPACITY) ||
-           ((uintptr_t)ptr >= (uintptr_t)bin_8 && (uintptr_t)ptr < (uintptr_t)bin_8 + BIN_8_CAPACITY * BIN_8_SIZE) ||
-           ((uintptr_t)ptr >= (uintptr_t)bin_16 && (uintptr_t)ptr < (uintptr_t)bin_16 + BIN_16_CAPACITY * BIN_16_SIZE) ||
-           ((uintptr_t)ptr >= (uintptr_t)bin_32 && (uintptr_t)ptr < (uintptr_t)bin_32 + BIN_32_CAPACITY * BIN_32_SIZE);
+// scans the words of [start, start + size) as roots in every collection, like a stack
+bool gc_register_root_range(void *start, size_t size)
+{
+    return add_range(gc_root_ranges, &gc_root_ranges_count, start, size);
 }
 
-static bool is_marked_allocation(void *ptr)
+void gc_unregister_root_range(void *start)
 {
-    ssize_t heap_index = search_by_ptr_in_alloc_array(ptr);
-    if (heap_index != -1)
+    pthread_mutex_lock(&gc_thread_lock);
+    for (size_t i = 0; i < gc_root_ranges_count; i++)
     {
-        return alloc_array[heap_index].mark;
+        if (gc_root_ranges[i].start == (void **)ALIGN_UP((size_t)start, sizeof(void *)))
+        {
+            gc_root_ranges[i] = gc_root_ranges[--gc_root_ranges_count];
+            break;
+        }
     }
+    pthread_mutex_unlock(&gc_thread_lock);
+}
 
-    if ((uintptr_t)ptr >= (uintptr_t)bin_8 && (uintptr_t)ptr < (uintptr_t)bin_8 + BIN_8_CAPACITY * BIN_8_SIZE)
+// keeps [start, start + size) out of the static data and the registered ranges the collector scans as roots,
+// for tables whose pointers must not keep anything alive
+bool gc_exclude_range(void *start, size_t size)
+{
+    return add_range(gc_excluded_ranges, &gc_excluded_ranges_count, start, size);
+}
+
+// returns the highest address of the calling thread's stack
+static void *thread_stack_top()
+{
+#if defined(__linux__)
+    pthread_attr_t attr;
+    if (pthread_getattr_np(pthread_self(), &attr) == 0)
     {
-        heap_index = search_by_ptr(ptr, alloc_bin_8, alloc_bin_8_size);
-        return (heap_index != -1) ? alloc_bin_8[heap_index].mark : false;
+        void *stack_base;
+        size_t stack_size;
+        pthread_attr_getstack(&attr, &stack_base, &stack_size);
+        pthread_attr_destroy(&attr);
+        return (char *)stack_base + stack_size;
     }
-    if ((uintptr_t)ptr >= (uintptr_t)bin_16 && (uintptr_t)ptr < (uintptr_t)bin_16 + BIN_16_CAPACITY * BIN_16_SIZE)
+#elif defined(__APPLE__)
+    return pthread_get_stackaddr_np(pthread_self());
+#endif
+    // unknown, so only frames below the caller are scanned
+    return __builtin_frame_address(0);
+}
+
+static void gc_suspend_handler(int signal)
+{
+    (void)signal;
+    if (gc_thread.in_barrier)
     {
-        heap_index = search_by_ptr(ptr, alloc_bin_16, alloc_bin_16_size);
-        return (heap_index != -1) ? alloc_bin_16[heap_index].mark : false;
+        gc_thread.suspend_deferred = 1;
+        return;
     }
-    if ((uintptr_t)ptr >= (uintptr_t)bin_32 && (uintptr_t)ptr < (uintptr_t)bin_32 + BIN_32_CAPACITY * BIN_32_SIZE)
+    int saved_errno = errno;
+
+    // spill the callee-saved registers below the signal frame, which holds the rest of them
+    jmp_buf registers;
+    setjmp(registers);
+    __atomic_store_n(&gc_thread.stack_pointer, (void *)&registers, __ATOMIC_RELAXED);
+    sem_post(&gc_thread_ack);
+
+    // every signal stays blocked until the collector resumes the world
+    sigset_t mask;
+    sigfillset(&mask);
+    sigdelset(&mask, GC_RESUME_SIGNAL);
+    do
     {
-        heap_index = search_by_ptr(ptr, alloc_bin_32, alloc_bin_32_size);
-        return (heap_index != -1) ? alloc_bin_32[heap_index].mark : false;
-    }
+        sigsuspend(&mask);
+    } while (__atomic_load_n(&gc_world_stopped, __ATOMIC_ACQUIRE));
 
-    return false;
+    sem_post(&gc_thread_ack);
+    errno = saved_errno;
 }
 
-static void mark_object(void *ptr)
+static void gc_resume_handler(int signal)
 {
-    if (!ptr || !is_valid_heap_ptr(ptr) || is_marked_allocation(ptr))
-    {
-        return;
-    }
+    (void)signal;
+}
 
-    ssize_t heap_index = search_by_ptr_in_alloc_array(ptr);
-    metadata_t *metadata = NULL;
+static inline void barrier_enter()
+{
+    gc_thread.in_barrier = 1;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+}
 
-    if (heap_index != -1)
-    {
-        metadata = &alloc_array[heap_index];
-    }
-    else
+static inline void barrier_exit()
+{
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    gc_thread.in_barrier = 0;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    if (gc_thread.suspend_deferred)
     {
-        if ((uintptr_t)ptr >= (uintptr_t)bin_8 && (uintptr_t)ptr < (uintptr_t)bin_8 + BIN_8_CAPACITY * BIN_8_SIZE)
-        {
-            heap_index = search_by_ptr(ptr, alloc_bin_8, alloc_bin_8_size);
-            metadata = (heap_index != -1) ? &alloc_bin_8[heap_index] : NULL;
-        }
-        else if ((uintptr_t)ptr >= (uintptr_t)bin_16 && (uintptr_t)ptr < (uintptr_t)bin_16 + BIN_16_CAPACITY * BIN_16_SIZE)
-        {
-            heap_index = search_by_ptr(ptr, alloc_bin_16, alloc_bin_16_size);
-            metadata = (heap_index != -1) ? &alloc_bin_16[heap_index] : NULL;
-        }
-        else if ((uintptr_t)ptr >= (uintptr_t)bin_32 && (uintptr_t)ptr < (uintptr_t)bin_32 + BIN_32_CAPACITY * BIN_32_SIZE)
-        {
-            heap_index = search_by_ptr(ptr, alloc_bin_32, alloc_bin_32_size);
-            metadata = (heap_index != -1) ? &alloc_bin_32[heap_index] : NULL;
-        }
+        // through the kernel, so the handler runs with every signal blocked and cannot miss the resume
+        gc_thread.suspend_deferred = 0;
+        raise(GC_SUSPEND_SIGNAL);
     }
+}
 
-    if (!metadata)
+static void gc_thread_exit(void *thread)
+{
+    (void)thread;
+    gc_unregister_thread();
+}
+
+static void gc_thread_init()
+{
+    sem_init(&gc_thread_ack, 0, 0);
+    pthread_key_create(&gc_thread_key, gc_thread_exit);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    sigfillset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    action.sa_handler = gc_suspend_handler;
+    sigaction(GC_SUSPEND_SIGNAL, &action, NULL);
+    action.sa_handler = gc_resume_handler;
+    sigaction(GC_RESUME_SIGNAL, &action, NULL);
+}
+
+// the calling thread's stack and registers are scanned by every collection until it unregisters or exits
+void gc_register_thread()
+{
+    if (gc_thread.registered)
+    {
         return;
+    }
 
-    metadata->mark = true;
+    pthread_once(&gc_thread_once, gc_thread_init);
+    gc_thread.thread = pthread_self();
+    gc_thread.stack_top = thread_stack_top();
+    pthread_setspecific(gc_thread_key, &gc_thread);
 
-    for (size_t offset = 0; offset < metadata->usable_size; offset += sizeof(void *))
+    pthread_mutex_lock(&gc_thread_lock);
+    gc_thread.prev = NULL;
+    gc_thread.next = gc_thread_list;
+    if (gc_thread_list)
     {
-        void *potential_ptr = *(void **)((char *)ptr + offset);
-        mark_object(potential_ptr);
+        gc_thread_list->prev = &gc_thread;
     }
+    gc_thread_list = &gc_thread;
+    gc_thread.registered = true;
+    pthread_mutex_unlock(&gc_thread_lock);
 }
 
-static void mark_roots()
+void gc_unregister_thread()
 {
-    for (size_t i = 0; i < gc_roots_count; i++)
+    if (!gc_thread.registered)
     {
-        mark_object(gc_roots[i]);
+        return;
     }
 
-    uintptr_t stack_bottom, stack_top;
-
-#if defined(__linux__)
-    void *stack_base;
-    size_t stack_size;
-    pthread_attr_t attr;
-    pthread_attr_init(&attr);
-    pthread_attr_getstack(&attr, &stack_base, &stack_size);
-    stack_bottom = (uintptr_t)stack_base;
-    stack_top = stack_bottom + stack_size;
-    pthread_attr_destroy(&attr);
-#elif defined(__APPLE__)
-    stack_bottom = (uintptr_t)pthread_get_stackaddr_np(pthread_self());
-    stack_top = stack_bottom - pthread_get_stacksize_np(pthread_self());
-#else
-    uintptr_t sp;
-    __asm__ __volatile__("mov %%rsp, %0" : "=r"(sp));
-    stack_bottom = sp;
-    stack_top = ;
-#endif
-
-    for (uintptr_t *ptr = (uintptr_t *)stack_bottom;
-         ptr < (uintptr_t *)stack_top;
-         ptr++)
+    pthread_mutex_lock(&gc_thread_lock);
+    if (gc_thread.prev)
     {
-        mark_object((void *)*ptr);
+        gc_thread.prev->next = gc_thread.next;
     }
-
-    for (void **ptr = (void **)&__data_start;
-         ptr < (void **)&_edata;
-         ptr++)
+    else
     {
-        mark_object(*ptr);
+        gc_thread_list = gc_thread.next;
     }
-
-    for (void **ptr = (void **)&__bss_start;
-         ptr < (void **)&_end;
-         ptr++)
+    if (gc_thread.next)
     {
-        mark_object(*ptr);
+        gc_thread.next->prev = gc_thread.prev;
     }
+    gc_thread.registered = false;
+    pthread_mutex_unlock(&gc_thread_lock);
+
+    pthread_setspecific(gc_thread_key, NULL);
 }
 
-static void sweep()
+static void wait_for_threads(size_t count)
 {
-    for (size_t i = 0; i < alloc_array_size; i++)
+    while (count)
     {
-        if (!alloc_array[i].mark)
-        {
-            heap_free(alloc_array[i].data_ptr);
-            i--;
-        }
-        else
+        if (sem_wait(&gc_thread_ack) == 0)
         {
-            alloc_array[i].mark = false;
+            count--;
         }
     }
+}
 
-    void (*sweep_bin)(void *) = heap_free;
+// signals every other registered thread and returns once all of them have stopped, gc_thread_lock must be held
+static size_t stop_world()
+{
+    size_t stopped = 0;
 
-    for (size_t i = 0; i < alloc_bin_8_size; i++)
+    __atomic_store_n(&gc_world_stopped, true, __ATOMIC_RELEASE);
+    for (gc_thread_t *thread = gc_thread_list; thread; thread = thread->next)
     {
-        if (!alloc_bin_8[i].mark)
+        __atomic_store_n(&thread->stack_pointer, NULL, __ATOMIC_RELAXED);
+        if (!pthread_equal(thread->thread, pthread_self()) && pthread_kill(thread->thread, GC_SUSPEND_SIGNAL) == 0)
         {
-            sweep_bin(alloc_bin_8[i].data_ptr);
-            i--;
-        }
-        else
-        {
-            alloc_bin_8[i].mark = false;
+            stopped++;
         }
     }
+    wait_for_threads(stopped);
 
-    for (size_t i = 0; i < alloc_bin_16_size; i++)
-    {
-        if (!alloc_bin_16[i].mark)
-        {
-            sweep_bin(alloc_bin_16[i].data_ptr);
-            i--;
-        }
-        else
-        {
-            alloc_bin_16[i].mark = false;
-        }
-    }
+    return stopped;
+}
 
-    for (size_t i = 0; i < alloc_bin_32_size; i++)
+static void resume_world(size_t stopped)
+{
+    __atomic_store_n(&gc_world_stopped, false, __ATOMIC_RELEASE);
+    for (gc_thread_t *thread = gc_thread_list; thread; thread = thread->next)
     {
-        if (!alloc_bin_32[i].mark)
+        if (thread->stack_pointer)
         {
-            sweep_bin(alloc_bin_32[i].data_ptr);
-            i--;
-        }
-        else
-        {
-            alloc_bin_32[i].mark = false;
+            pthread_kill(thread->thread, GC_RESUME_SIGNAL);
+            thread->stack_pointer = NULL;
         }
     }
+
+    // wait until they are out of the handler, so the next collection cannot find one still in it
+    wait_for_threads(stopped);
 }
 
-void gc_collect()
+// with GC_INTERIOR_POINTERS an allocated chunk has exactly one start bit within it, at its data; the bits left in
+// free chunks are stale, and only ever lead to a chunk that fails find_allocation or does not reach ptr
+static void record_chunk_start(metadata_t *chunk)
 {
-    static bool collecting = false;
-    if (collecting)
+    segment_t *segment = segment_for_ptr(chunk->chunk_ptr);
+    if (!segment->starts)
+    {
         return;
-    collecting = true;
-
-    mark_roots();
-
-    sweep();
+    }
 
-    collecting = false;
+    size_t first = (size_t)((uint8_t *)chunk->chunk_ptr - segment->memory) >> TLSF_GRANULE_LOG2;
+    size_t end = first + (chunk->size >> TLSF_GRANULE_LOG2);
+    size_t start = (size_t)((uint8_t *)chunk->data_ptr - segment->memory) >> TLSF_GRANULE_LOG2;
+    for (size_t bit = first; bit < end;)
+    {
+        size_t count = end - bit < 64 - bit % 64 ? end - bit : 64 - bit % 64;
+        segment->starts[bit / 64] &= ~((count == 64 ? ~0ULL : (1ULL << count) - 1) << (bit % 64));
+        if (!segment->starts[bit / 64] && bit / 64 != start / 64)
+        {
+            BITMAP_CLEAR(segment->start_words, bit / 64);
+        }
+        bit += count;
+    }
+    BITMAP_SET(segment->starts, start);
+    BITMAP_SET(segment->start_words, start / 64);
 }
 
-#endif
-
-static ssize_t search_by_ptr(void *ptr, metadata_t *array, size_t array_size)
+// the allocated chunk whose data holds ptr, from the nearest start bit at or below it; heap chunks are smaller
+// than LARGE_OBJECT_THRESHOLD, and arena chunks, which may be larger, are kept alive by their arena anyway, so
+// the search stops that far back. Empty words of starts are skipped through start_words, 64 at a time: a miss
+// reads at most LARGE_OBJECT_THRESHOLD / 32KB + 2 words of start_words, 10 by default, and two of starts
+static metadata_t *find_interior(segment_t *segment, void *ptr)
 {
-    size_t left = 0;
-    size_t right = array_size;
+    size_t bit = (size_t)((uint8_t *)ptr - segment->memory) >> TLSF_GRANULE_LOG2;
+    if ((uint8_t *)ptr < segment->memory || bit >= segment->size >> TLSF_GRANULE_LOG2)
+    {
+        return NULL;
+    }
 
-    while (left < right)
+    size_t word = bit / 64;
+    size_t reach = (LARGE_OBJECT_THRESHOLD >> TLSF_GRANULE_LOG2) + 64; // a word more for padding and split remainders
+    size_t last_word = bit > reach ? (bit - reach) / 64 : 0;
+    uint64_t bits = segment->starts[word] & (~0ULL >> (63 - bit % 64));
+    while (!bits)
     {
-        size_t mid = (left + right) / 2;
-        if (array[mid].data_ptr == ptr)
+        // the nearest lower word of starts that holds a start, a word of start_words at a time
+        size_t summary = word / 64;
+        uint64_t words = segment->start_words[summary] & ((1ULL << (word % 64)) - 1);
+        while (!words && summary > last_word / 64)
         {
-            return mid;
+            words = segment->start_words[--summary];
         }
-        if (array[mid].data_ptr < ptr)
+        if (!words)
         {
-            left = mid + 1;
+            return NULL;
         }
-        else
+        word = summary * 64 + 63 - __builtin_clzll(words);
+        if (word < last_word)
         {
-            right = mid;
+            return NULL;
         }
+        // a start cleared since start_words was read only sends the search further down
+        bits = segment->starts[word];
     }
-    return -1;
-}
-
-static ssize_t search_by_ptr_in_free_array(void *ptr)
-{
-    return search_by_ptr(ptr, free_array, free_array_size);
-}
 
-static ssize_t search_by_ptr_in_alloc_array(void *ptr)
-{
-    return search_by_ptr(ptr, alloc_array, alloc_array_size);
+    uint8_t *start = segment->memory + ((word * 64 + 63 - __builtin_clzll(bits)) << TLSF_GRANULE_LOG2);
+    metadata_t *chunk = find_allocation(segment, start);
+    return chunk && (uint8_t *)ptr < start + chunk->usable_size ? chunk : NULL;
 }
 
-static ssize_t search_by_size_in_free_array(size_t size, alignment_t alignment)
+// marks the allocation holding ptr, which with GC_INTERIOR_POINTERS may point anywhere inside it, and returns its
+// start, size and layout, or 0 if there is none or it was already marked;
+// markers race on the same objects, so the mark is claimed atomically and only one of them scans it
+static size_t mark_allocation(void *ptr, void **start, const gc_type_t **type)
 {
-    size_t left = 0;
-    size_t right = free_array_size;
-    ssize_t best_fit = -1;
-    size_t smallest_sufficient_size = SIZE_MAX;
-
-    while (left < right)
+    segment_t *segment = ptr ? segment_for_ptr(ptr) : NULL;
+    if (!segment)
     {
-        size_t mid = (left + right) / 2;
-        metadata_t *current = &free_array[mid];
+        return 0;
+    }
 
-        size_t padding = ((alignment - (size_t)current->chunk_ptr) & (alignment - 1));
-        size_t total_required = size + padding;
+    size_t usable_size;
+    size_t slot;
 
-        if (current->size >= total_required)
-        {
-            if (current->size < smallest_sufficient_size)
-            {
-                smallest_sufficient_size = current->size;
-                best_fit = mid;
-            }
-            right = mid;
-        }
-        else
+    if (segment->kind == SEGMENT_SLAB)
+    {
+        // a slot is found by size class arithmetic, whatever it points at
+        if (GC_INTERIOR_POINTERS)
         {
-            left = mid + 1;
+            slot = BIN_SLOT(segment, ptr);
+            if ((uint8_t *)ptr < segment->memory || slot >= segment->capacity || !BITMAP_TEST(segment->used, slot))
+                return 0;
         }
+        else if (!slab_slot(segment, ptr, &slot) || !BITMAP_TEST(segment->used, slot))
+            return 0;
+
+        uint64_t mask = 1ULL << (slot % 64);
+        if (__atomic_fetch_or(&segment->marks[slot / 64], mask, __ATOMIC_RELAXED) & mask)
+            return 0;
+
+        *type = slab_slot_type(segment, slot);
+        *start = segment->memory + slot * segment->slot_size;
+        usable_size = segment->slot_size - (*type && *type != &gc_atomic_type ? sizeof(void *) : 0);
+    }
+    else if (segment->kind == SEGMENT_LARGE)
+    {
+        bool inside = GC_INTERIOR_POINTERS ? (size_t)((uint8_t *)ptr - segment->memory) < segment->size
+                                           : ptr == segment->memory;
+        if (!inside || __atomic_exchange_n(&segment->mark, true, __ATOMIC_RELAXED))
+            return 0;
+
+        *type = segment->gc_type;
+        *start = segment->memory;
+        usable_size = segment->size;
+    }
+    else
+    {
+        metadata_t *metadata = segment->kind != SEGMENT_HEAP ? NULL
+                               : segment->starts      ? find_interior(segment, ptr)
+                                                      : find_allocation(segment, ptr);
+        if (!metadata)
+            return 0;
+
+        size_t bit = HEAP_MARK_BIT(segment, metadata);
+        uint64_t mask = 1ULL << (bit % 64);
+        if (__atomic_fetch_or(&segment->marks[bit / 64], mask, __ATOMIC_RELAXED) & mask)
+            return 0;
+
+        *type = metadata->gc_type;
+        *start = metadata->data_ptr;
+        usable_size = metadata->usable_size;
     }
 
-    return best_fit;
+    return usable_size;
 }
 
-static inline alignment_t calculate_alignment(const void *ptr)
+// queues a grey range, returns false when the deque is full
+static bool mark_push(size_t marker, void **start, void **end, const gc_type_t *type)
 {
-    uintptr_t addr = (uintptr_t)ptr;
-    size_t alignment = ALIGN_1;
+    mark_deque_t *deque = &mark_deques[marker];
 
-    while (alignment <= MAX_ALIGNMENT && !(addr & (alignment - 1)))
+    pthread_mutex_lock(&deque->lock);
+    size_t top = deque->top;
+    size_t bottom = deque->bottom;
+    if (bottom == deque->capacity && top)
     {
-        alignment = (alignment << 1);
+        // slide the live ranges down over the stolen ones
+        memmove(deque->items, deque->items + top, (bottom - top) * sizeof(mark_range_t));
+        bottom -= top;
+        top = 0;
+        __atomic_store_n(&deque->top, top, __ATOMIC_RELAXED);
     }
 
-    return (alignment_t)(alignment >> 1);
-}
-
-static bool remove_from_array(size_t index, metadata_t *array, size_t *array_size)
-{
-    if (index >= *array_size)
+    bool full = bottom == deque->capacity;
+    if (!full)
     {
-        return false;
+        deque->items[bottom] = (mark_range_t){start, end, type};
+        __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELEASE);
     }
+    else
+    {
+        __atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&deque->lock);
 
-    memmove(&array[index], &array[index + 1],
-            (*array_size - index - 1) * sizeof(metadata_t));
-    (*array_size)--;
-    return true;
+    return !full;
 }
 
-static bool remove_from_free_array(size_t index)
+static bool mark_pop(size_t marker, mark_range_t *range)
 {
-    return remove_from_array(index, free_array, &free_array_size);
-}
+    mark_deque_t *deque = &mark_deques[marker];
+    bool found = false;
 
-static bool remove_from_alloc_array(size_t index)
-{
-    return remove_from_array(index, alloc_array, &alloc_array_size);
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom > deque->top)
+    {
+        *range = deque->items[deque->bottom - 1];
+        __atomic_store_n(&deque->bottom, deque->bottom - 1, __ATOMIC_RELAXED);
+        found = true;
+    }
+    else if (deque->top)
+    {
+        __atomic_store_n(&deque->top, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&deque->bottom, 0, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&deque->lock);
+
+    return found;
 }
 
-static size_t find_insertion_position(void *data_ptr, metadata_t *array, size_t array_size)
+static bool mark_steal(size_t marker, mark_range_t *range)
 {
-    size_t left = 0;
-    size_t right = array_size;
-
-    while (left < right)
+    for (size_t i = 1; i < gc_markers; i++)
     {
-        size_t mid = (left + right) / 2;
-        if (array[mid].data_ptr <= data_ptr)
+        mark_deque_t *victim = &mark_deques[(marker + i) % gc_markers];
+        if (__atomic_load_n(&victim->bottom, __ATOMIC_ACQUIRE) == __atomic_load_n(&victim->top, __ATOMIC_RELAXED))
         {
-            left = mid + 1;
+            continue;
         }
-        else
+
+        bool found = false;
+        pthread_mutex_lock(&victim->lock);
+        if (victim->bottom > victim->top)
+        {
+            *range = victim->items[victim->top];
+            __atomic_store_n(&victim->top, victim->top + 1, __ATOMIC_RELAXED);
+            found = true;
+        }
+        pthread_mutex_unlock(&victim->lock);
+
+        if (found)
         {
-            right = mid;
+            return true;
         }
     }
-    return left;
+
+    return false;
 }
 
-static bool add_into_array(metadata_t chunk, metadata_t *array, size_t *array_size, size_t capacity)
+static bool mark_work_available()
 {
-    if (*array_size >= capacity)
+    for (size_t marker = 0; marker < gc_markers; marker++)
     {
-        return false;
+        mark_deque_t *deque = &mark_deques[marker];
+        if (__atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE) != __atomic_load_n(&deque->top, __ATOMIC_RELAXED))
+        {
+            return true;
+        }
     }
 
-    size_t pos = find_insertion_position(chunk.data_ptr, array, *array_size);
+    return false;
+}
 
-    if (pos < *array_size)
+// words a work item may span, a whole number of elements for a typed range
+static size_t mark_chunk_words(const gc_type_t *type)
+{
+    if (!type)
     {
-        memmove(&array[pos + 1], &array[pos],
-                (*array_size - pos) * sizeof(metadata_t));
+        return GC_MARK_CHUNK;
     }
 
-    array[pos] = chunk;
-    (*array_size)++;
-    return true;
+    size_t words = type->size / sizeof(void *);
+    return words < GC_MARK_CHUNK ? GC_MARK_CHUNK / words * words : words;
 }
 
-static bool add_into_free_array(void *chunk_ptr, void *data_ptr, void *prev_chunk_ptr,
-                                size_t size, size_t usable_size, alignment_t alignment)
+static void mark_word(size_t marker, void *word)
 {
-    metadata_t chunk = {
-        .chunk_ptr = chunk_ptr,
-        .data_ptr = data_ptr,
-        .prev_chunk_ptr = prev_chunk_ptr,
-        .size = size,
-        .usable_size = usable_size,
-        .current_alignment = alignment};
-    return add_into_array(chunk, free_array, &free_array_size, FREE_CAPACITY);
-}
+    void *object;
+    const gc_type_t *type = NULL;
+    size_t usable_size = mark_allocation(word, &object, &type);
+    if (!usable_size)
+    {
+        return;
+    }
+    __atomic_fetch_add(&mark_deques[marker].marked_bytes, usable_size, __ATOMIC_RELAXED);
+    if (type && !type->pointers)
+    {
+        return;
+    }
 
-static bool add_into_alloc_array(void *chunk_ptr, void *data_ptr, void *prev_chunk_ptr,
-                                 size_t size, size_t usable_size, alignment_t alignment)
-{
-    metadata_t chunk = {
-        .chunk_ptr = chunk_ptr,
-        .data_ptr = data_ptr,
-        .prev_chunk_ptr = prev_chunk_ptr,
-        .size = size,
-        .usable_size = usable_size,
-        .current_alignment = alignment};
-    return add_into_array(chunk, alloc_array, &alloc_array_size, ALLOC_CAPACITY);
+    // start fetching the object now, it is scanned once the rest of this range is done
+    __builtin_prefetch(object);
+    if (!mark_push(marker, (void **)object, (void **)((char *)object + usable_size), type))
+    {
+        // it stays marked, mark_rescan finds it again
+        __atomic_store_n(&gc_mark_overflowed, true, __ATOMIC_RELAXED);
+    }
 }
 
-static void defragment_heap()
+// conservative scanning: most words are small integers, or point at the stacks, libraries or the libc heap, and
+// testing them against the span of the segments first keeps them away from the page map
+static void scan_words(size_t marker, void **start, void **end)
 {
-    bool defragmented;
-    do
+    uintptr_t low = __atomic_load_n(&segment_span_low, __ATOMIC_RELAXED);
+    uintptr_t span = __atomic_load_n(&segment_span_high, __ATOMIC_RELAXED) - low;
+
+    for (void **ptr = start; ptr < end; ptr++)
     {
-        defragmented = false;
-        for (size_t i = 0; i < free_array_size; i++)
+        if ((uintptr_t)*ptr - low < span)
         {
-            metadata_t *current = &free_array[i];
-
-            void *next_chunk = (uint8_t *)current->chunk_ptr + current->size;
-            for (size_t j = 0; j < free_array_size; j++)
-            {
-                if (i != j && free_array[j].chunk_ptr == next_chunk)
-                {
-                    current->size += free_array[j].size;
-                    remove_from_free_array(j);
-                    defragmented = true;
-                    break;
-                }
-            }
-
-            ssize_t prev_idx = search_by_ptr_in_free_array(current->prev_chunk_ptr);
-            if (prev_idx >= 0)
-            {
-                metadata_t *prev = &free_array[prev_idx];
-                prev->size += current->size;
-                remove_from_free_array(i);
-                defragmented = true;
-                break;
-            }
+            mark_word(marker, *ptr);
         }
-    } while (defragmented);
+    }
 }
 
-void heap_init()
+#if defined(__x86_64__)
+// the vector filters test whether a word minus the low end of the span is below the next power of two above the
+// span, then the words that pass get the exact test
+static void mark_candidate(size_t marker, void *word, uintptr_t low, uintptr_t span)
 {
-    static bool has_run = false;
-    if (has_run)
+    if ((uintptr_t)word - low < span)
     {
-        return;
+        mark_word(marker, word);
     }
-
-    has_run = true;
-    free_array_size = 0;
-    alloc_array_size = 0;
-
-    add_into_free_array(heap, heap, NULL, HEAP_CAPACITY, HEAP_CAPACITY, MAX_ALIGNMENT);
-    free_array[0].alloc_type = ALLOC_TYPE_HEAP;
-
-    init_bins();
 }
 
-void *heap_alloc(size_t size, alignment_t alignment)
+__attribute__((target("avx2"))) static void scan_words_avx2(size_t marker, void **start, void **end)
 {
-    if (!size)
+    uintptr_t low = __atomic_load_n(&segment_span_low, __ATOMIC_RELAXED);
+    uintptr_t high = __atomic_load_n(&segment_span_high, __ATOMIC_RELAXED);
+    if (high <= low)
     {
-        return NULL;
+        return;
     }
+    uintptr_t span = high - low;
+    __m128i shift = _mm_cvtsi32_si128(span > 1 ? 64 - __builtin_clzll(span - 1) : 0);
+    __m256i base = _mm256_set1_epi64x((long long)low);
+    __m256i zero = _mm256_setzero_si256();
 
-    heap_init();
-
-    if (((alignment) & (alignment - 1)) || (alignment > MAX_ALIGNMENT))
+    void **ptr = start;
+    for (; ptr + 4 <= end; ptr += 4)
     {
-        alignment = DEFAULT_ALIGNMENT;
+        __m256i words = _mm256_loadu_si256((const __m256i *)ptr);
+        __m256i outside = _mm256_srl_epi64(_mm256_sub_epi64(words, base), shift);
+        int candidates = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(outside, zero)));
+        if (candidates)
+        {
+            // the words as they were tested, a mutator may change them during incremental marking
+            void *copy[4];
+            _mm256_storeu_si256((__m256i *)copy, words);
+            for (; candidates; candidates &= candidates - 1)
+            {
+                mark_candidate(marker, copy[__builtin_ctz(candidates)], low, span);
+            }
+        }
     }
-
-    metadata_t *target_free_array;
-    metadata_t *target_alloc_array;
-    size_t *target_free_size;
-    size_t *target_alloc_size;
-    size_t target_capacity;
-    allocation_type_t alloc_type;
-
-    if (size <= BIN_8_SIZE)
+    for (; ptr < end; ptr++)
     {
-        target_free_array = free_bin_8;
-        target_alloc_array = alloc_bin_8;
-        target_free_size = &free_bin_8_size;
-        target_alloc_size = &alloc_bin_8_size;
-        target_capacity = BIN_8_CAPACITY;
-        size = BIN_8_SIZE;
-        alloc_type = ALLOC_TYPE_BIN_8;
+        mark_candidate(marker, *ptr, low, span);
     }
-    else if (size <= BIN_16_SIZE)
+}
+
+static void scan_words_sse2(size_t marker, void **start, void **end)
+{
+    uintptr_t low = __atomic_load_n(&segment_span_low, __ATOMIC_RELAXED);
+    uintptr_t high = __atomic_load_n(&segment_span_high, __ATOMIC_RELAXED);
+    if (high <= low)
+    {
+        return;
+    }
+    uintptr_t span = high - low;
+    __m128i shift = _mm_cvtsi32_si128(span > 1 ? 64 - __builtin_clzll(span - 1) : 0);
+    __m128i base = _mm_set1_epi64x((long long)low);
+    __m128i zero = _mm_setzero_si128();
+
+    void **ptr = start;
+    for (; ptr + 2 <= end; ptr += 2)
+    {
+        __m128i words = _mm_loadu_si128((const __m128i *)ptr);
+        __m128i outside = _mm_srl_epi64(_mm_sub_epi64(words, base), shift);
+        // no 64 bit compare before SSE4.1, a word passes when both of its halves are zero
+        int halves = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(outside, zero)));
+        if (halves & (halves >> 1) & 0x5)
+        {
+            void *copy[2];
+            _mm_storeu_si128((__m128i *)copy, words);
+            if ((halves & 0x3) == 0x3)
+            {
+                mark_candidate(marker, copy[0], low, span);
+            }
+            if ((halves & 0xc) == 0xc)
+            {
+                mark_candidate(marker, copy[1], low, span);
+            }
+        }
+    }
+    for (; ptr < end; ptr++)
+    {
+        mark_candidate(marker, *ptr, low, span);
+    }
+}
+#endif
+
+// chosen by gc_start_markers for the processor it runs on
+static void (*scan_conservative)(size_t marker, void **start, void **end) = scan_words;
+
+static void scan_range(size_t marker, void **start, void **end, const gc_type_t *type)
+{
+    if (!type)
+    {
+        scan_conservative(marker, start, end);
+        return;
+    }
+
+    if (!type->pointers)
+    {
+        return;
+    }
+
+    // only the words the layout marks as pointers are visited
+    size_t words = type->size / sizeof(void *);
+    for (void **element = start; element < end; element += words)
+    {
+        for (size_t i = 0; i < (words + 63) / 64; i++)
+        {
+            for (uint64_t bits = type->pointers[i]; bits; bits &= bits - 1)
+            {
+                void **ptr = element + i * 64 + __builtin_ctzll(bits);
+                if (ptr >= end)
+                {
+                    return; // the last element may be cut short
+                }
+                mark_word(marker, *ptr);
+            }
+        }
+    }
+}
+
+// scans grey ranges until every marker has run out of work
+static void mark_drain(size_t marker)
+{
+    mark_range_t range;
+
+    for (;;)
+    {
+        if (mark_pop(marker, &range) || mark_steal(marker, &range))
+        {
+            // leave the tail where other markers can steal it
+            size_t chunk = mark_chunk_words(range.type);
+            if ((size_t)(range.end - range.start) > chunk &&
+                mark_push(marker, range.start + chunk, range.end, range.type))
+            {
+                range.end = range.start + chunk;
+            }
+            scan_range(marker, range.start, range.end, range.type);
+            continue;
+        }
+
+        // a marker only goes idle with an empty deque, so once all are idle no work is left anywhere
+        __atomic_add_fetch(&gc_idle_markers, 1, __ATOMIC_ACQ_REL);
+        while (!mark_work_available())
+        {
+            if (__atomic_load_n(&gc_idle_markers, __ATOMIC_ACQUIRE) == gc_markers)
+            {
+                return;
+            }
+            sched_yield();
+        }
+        __atomic_sub_fetch(&gc_idle_markers, 1, __ATOMIC_ACQ_REL);
+    }
+}
+
+static void *gc_marker_main(void *arg)
+{
+    size_t marker = (size_t)arg;
+    size_t cycle = 0;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&gc_pool_lock);
+        while (gc_cycle == cycle)
+        {
+            pthread_cond_wait(&gc_cycle_started, &gc_pool_lock);
+        }
+        cycle = gc_cycle;
+        pthread_mutex_unlock(&gc_pool_lock);
+
+        mark_drain(marker);
+
+        pthread_mutex_lock(&gc_pool_lock);
+        if (++gc_finished_markers == gc_markers - 1)
+        {
+            pthread_cond_signal(&gc_cycle_finished);
+        }
+        pthread_mutex_unlock(&gc_pool_lock);
+    }
+
+    return NULL;
+}
+
+static void gc_start_markers()
+{
+#if defined(__x86_64__)
+    scan_conservative = __builtin_cpu_supports("avx2") ? scan_words_avx2 : scan_words_sse2;
+#endif
+
+    for (size_t marker = 0; marker < GC_MARK_THREADS; marker++)
+    {
+        mark_deque_t *deque = &mark_deques[marker];
+        pthread_mutex_init(&deque->lock, NULL);
+
+        // without a deque every push overflows: objects are left marked but unscanned until mark_rescan
+        void *items = mmap(NULL, GC_DEQUE_CAPACITY * sizeof(mark_range_t), PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        deque->items = items == MAP_FAILED ? NULL : items;
+        deque->capacity = deque->items ? GC_DEQUE_CAPACITY : 0;
+    }
+
+    // the pool threads idle between collections, and gc_markers only counts the ones that started
+    for (size_t marker = 1; marker < GC_MARK_THREADS; marker++)
+    {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, gc_marker_main, (void *)marker) != 0)
+        {
+            break;
+        }
+        pthread_detach(thread);
+        gc_markers++;
+    }
+}
+
+// hands a root range to the markers in pieces, round robin, so they all start with work;
+// an incremental snapshot scans them right away instead, stacks change once the world resumes
+static void mark_push_roots(void **start, void **end, const gc_type_t *type)
+{
+    static size_t next_marker = 0;
+    size_t chunk = mark_chunk_words(type);
+
+    while (start < end)
+    {
+        void **piece_end = (size_t)(end - start) > chunk ? start + chunk : end;
+        if (gc_snapshot_roots || !mark_push(next_marker, start, piece_end, type))
+        {
+            scan_range(next_marker, start, piece_end, type);
+        }
+        next_marker = (next_marker + 1) % gc_markers;
+        start = piece_end;
+    }
+}
+
+// slots parked in thread caches are allocated as far as the bins know, but must never be swept
+static void mark_cached_slots()
+{
+    for (tcache_t *cache = tcache_list; cache; cache = cache->next)
+    {
+        for (size_t index = 0; index < BIN_COUNT; index++)
+        {
+            for (size_t i = 0; i < cache->count[index]; i++)
+            {
+                size_t slot;
+                segment_t *slab = slab_for_ptr(cache->slots[index][i], &slot);
+                if (slab)
+                {
+                    BITMAP_SET(slab->marks, slot);
+                }
+            }
+        }
+    }
+}
+
+// arena chunks are kept alive as long as their arena is, but only the bytes handed out are scanned
+static void mark_arenas()
+{
+    for (heap_arena_t *arena = arena_list; arena; arena = arena->next)
+    {
+        bool in_use = arena->current != NULL;
+        void *start;
+        const gc_type_t *type;
+
+        mark_allocation(arena, &start, &type);
+        for (arena_chunk_t *chunk = arena->head; chunk; chunk = chunk->next)
+        {
+            mark_allocation(chunk, &start, &type);
+            if (in_use)
+            {
+                mark_push_roots((void **)ARENA_CHUNK_DATA(chunk), (void **)chunk->top, NULL);
+            }
+            if (chunk == arena->current)
+            {
+                in_use = false;
+            }
+        }
+    }
+}
+
+// queues the parts of [start, end) that lie on dirty cards of segment
+static void mark_dirty_range(segment_t *segment, uint8_t *start, uint8_t *end)
+{
+    size_t last = CARD_INDEX(segment, end - 1);
+
+    for (size_t card = CARD_INDEX(segment, start); card <= last; card++)
+    {
+        if (!segment->cards[card])
+        {
+            continue;
+        }
+
+        size_t first = card;
+        while (card < last && segment->cards[card + 1])
+        {
+            card++;
+        }
+
+        uint8_t *from = segment->memory + (first << GC_CARD_SHIFT);
+        uint8_t *to = segment->memory + ((card + 1) << GC_CARD_SHIFT);
+        mark_push_roots((void **)(from > start ? from : start), (void **)(to < end ? to : end), NULL);
+    }
+}
+
+// old objects are not traced by a minor collection, so the young objects stored into them since the last one
+// are found through the cards gc_write_barrier dirtied; the dirty parts of typed objects are scanned conservatively
+static void mark_dirty_cards()
+{
+    for (segment_t *segment = segment_list; segment; segment = segment->next)
+    {
+        if (!segment->dirty)
+        {
+            continue;
+        }
+
+        if (segment->kind == SEGMENT_LARGE)
+        {
+            if (segment->mark && segment->gc_type != &gc_atomic_type)
+            {
+                mark_push_roots((void **)segment->memory, (void **)(segment->memory + segment->size), NULL);
+            }
+        }
+        else if (segment->kind == SEGMENT_HEAP)
+        {
+            for (metadata_t *chunk = segment->first_chunk; chunk; chunk = chunk->next_phys)
+            {
+                if (!chunk->is_free && chunk->gc_type != &gc_atomic_type &&
+                    BITMAP_TEST(segment->marks, HEAP_MARK_BIT(segment, chunk)))
+                {
+                    mark_dirty_range(segment, chunk->data_ptr, (uint8_t *)chunk->data_ptr + chunk->usable_size);
+                }
+            }
+        }
+        else if (segment->kind == SEGMENT_SLAB)
+        {
+            for (size_t word = 0; word < segment->capacity / 64; word++)
+            {
+                for (uint64_t old = segment->used[word] & segment->marks[word] & ~segment->atomic[word]; old; old &= old - 1)
+                {
+                    uint8_t *slot = segment->memory + (word * 64 + __builtin_ctzll(old)) * segment->slot_size;
+                    mark_dirty_range(segment, slot, slot + segment->slot_size);
+                }
+            }
+        }
+    }
+}
+
+// a full generational collection starts over with every object young
+static void clear_marks()
+{
+    for (segment_t *segment = segment_list; segment; segment = segment->next)
+    {
+        if (segment->kind == SEGMENT_HEAP)
+        {
+            memset(segment->marks, 0, HEAP_MARK_WORDS(segment->size) * sizeof(uint64_t));
+        }
+        else if (segment->kind == SEGMENT_SLAB)
+        {
+            memset(segment->marks, 0, (segment->capacity / 64) * sizeof(uint64_t));
+        }
+        segment->mark = false;
+    }
+}
+
+// every survivor is old once a collection ends, so no old object can point at a young one yet
+static void clear_cards()
+{
+    for (segment_t *segment = segment_list; segment; segment = segment->next)
+    {
+        if (segment->dirty && segment->cards)
+        {
+            memset(segment->cards, 0, CARD_COUNT(segment->size));
+        }
+        segment->dirty = false;
+    }
+}
+
+// thread cache slots were only marked to survive the sweep, they must not stay old
+static void unmark_cached_slots()
+{
+    for (tcache_t *cache = tcache_list; cache; cache = cache->next)
+    {
+        for (size_t index = 0; index < BIN_COUNT; index++)
+        {
+            for (size_t i = 0; i < cache->count[index]; i++)
+            {
+                size_t slot;
+                segment_t *slab = slab_for_ptr(cache->slots[index][i], &slot);
+                if (slab)
+                {
+                    BITMAP_CLEAR(slab->marks, slot);
+                }
+            }
+        }
+    }
+}
+
+// hands the parts of [start, end) outside every excluded range to mark_push_roots
+static void mark_root_range(void **start, void **end)
+{
+    while (start < end)
+    {
+        // the excluded range that covers the lowest address still left
+        void **skip_start = end;
+        void **skip_end = end;
+        for (size_t i = 0; i < gc_excluded_ranges_count; i++)
+        {
+            // the built in byte tables may end mid word, a word holding a pointer never shares their last one
+            void **excluded_start = (void **)((size_t)gc_excluded_ranges[i].start & ~(sizeof(void *) - 1));
+            void **excluded_end = (void **)ALIGN_UP((size_t)gc_excluded_ranges[i].end, sizeof(void *));
+            void **overlap = excluded_start > start ? excluded_start : start;
+            if (excluded_end > start && overlap < skip_start)
+            {
+                skip_start = overlap;
+                skip_end = excluded_end;
+            }
+        }
+
+        mark_push_roots(start, skip_start, NULL);
+        start = skip_end;
+    }
+}
+
+// queues every root range on the marker deques, nothing is scanned yet;
+// the collector's own live stack is [stack_pointer, stack_top), every other registered thread is stopped
+static void mark_roots(void **stack_pointer, void **stack_top, bool minor)
+{
+    // before anything new is marked, so only old objects count
+    if (minor)
+    {
+        mark_dirty_cards();
+    }
+
+    mark_cached_slots();
+    mark_arenas();
+
+    for (size_t i = 0; i < gc_roots_count; i++)
+    {
+        void *root;
+        const gc_type_t *type = NULL;
+        size_t usable_size = mark_allocation(gc_roots[i], &root, &type);
+        if (usable_size && (!type || type->pointers))
+        {
+            mark_push_roots((void **)root, (void **)((char *)root + usable_size), type);
+        }
+    }
+
+    mark_push_roots(stack_pointer, stack_top, NULL);
+    for (gc_thread_t *thread = gc_thread_list; thread; thread = thread->next)
+    {
+        if (thread->stack_pointer)
+        {
+            mark_push_roots((void **)thread->stack_pointer, (void **)thread->stack_top, NULL);
+        }
+    }
+
+    for (size_t i = 0; i < gc_root_ranges_count; i++)
+    {
+        mark_root_range(gc_root_ranges[i].start, gc_root_ranges[i].end);
+    }
+    mark_root_range((void **)&__data_start, (void **)&_edata);
+    mark_root_range((void **)&__bss_start, (void **)&_end);
+}
+
+// wakes the pool, marks alongside it as marker 0 and returns once every marker is done
+static void mark_parallel()
+{
+    __atomic_store_n(&gc_idle_markers, 0, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&gc_pool_lock);
+    gc_finished_markers = 0;
+    gc_cycle++;
+    pthread_cond_broadcast(&gc_cycle_started);
+    pthread_mutex_unlock(&gc_pool_lock);
+
+    mark_drain(0);
+
+    pthread_mutex_lock(&gc_pool_lock);
+    while (gc_finished_markers < gc_markers - 1)
+    {
+        pthread_cond_wait(&gc_cycle_finished, &gc_pool_lock);
+    }
+    pthread_mutex_unlock(&gc_pool_lock);
+}
+
+// scans grey ranges on the calling thread until about budget words are done, returns how many were
+static size_t mark_step(size_t budget)
+{
+    size_t done = 0;
+    mark_range_t range;
+
+    while (done < budget && (mark_pop(0, &range) || mark_steal(0, &range)))
+    {
+        size_t chunk = mark_chunk_words(range.type);
+        if ((size_t)(range.end - range.start) > chunk && mark_push(0, range.start + chunk, range.end, range.type))
+        {
+            range.end = range.start + chunk;
+        }
+        scan_range(0, range.start, range.end, range.type);
+        done += range.end - range.start;
+    }
+
+    return done;
+}
+
+// after a deque overflowed, scans every marked object again so the children that were dropped get queued;
+// marking only ever grows, so repeating this until nothing overflows terminates
+static void mark_rescan()
+{
+    for (segment_t *segment = segment_list; segment; segment = segment->next)
+    {
+        if (segment->kind == SEGMENT_HEAP)
+        {
+            for (metadata_t *chunk = segment->first_chunk; chunk; chunk = chunk->next_phys)
+            {
+                if (!chunk->is_free && BITMAP_TEST(segment->marks, HEAP_MARK_BIT(segment, chunk)))
+                {
+                    scan_range(0, (void **)chunk->data_ptr, (void **)((char *)chunk->data_ptr + chunk->usable_size),
+                               chunk->gc_type);
+                }
+            }
+        }
+        else if (segment->kind == SEGMENT_LARGE && segment->mark)
+        {
+            scan_range(0, (void **)segment->memory, (void **)(segment->memory + segment->size), segment->gc_type);
+        }
+        else if (segment->kind == SEGMENT_SLAB)
+        {
+            for (size_t word = 0; word < segment->capacity / 64; word++)
+            {
+                for (uint64_t live = segment->used[word] & segment->marks[word] & ~segment->atomic[word]; live;
+                     live &= live - 1)
+                {
+                    size_t slot = word * 64 + __builtin_ctzll(live);
+                    const gc_type_t *type = slab_slot_type(segment, slot);
+                    uint8_t *start = segment->memory + slot * segment->slot_size;
+                    uint8_t *end = start + segment->slot_size - (type ? sizeof(void *) : 0);
+                    scan_range(0, (void **)start, (void **)end, type);
+                }
+            }
+        }
+    }
+}
+
+// frees every unmarked chunk in one pass over the segment, merging each run of free and dead chunks as it goes
+static void sweep_heap_segment(segment_t *segment)
+{
+    metadata_t *run = NULL;
+    segment->unswept = false;
+
+    for (metadata_t *chunk = segment->first_chunk, *next; chunk; chunk = next)
+    {
+        next = chunk->next_phys;
+        if (!chunk->is_free && BITMAP_TEST(segment->marks, HEAP_MARK_BIT(segment, chunk)))
+        {
+            if (run)
+            {
+                tlsf_insert(run);
+                run = NULL;
+            }
+            continue;
+        }
+
+        if (chunk->is_free)
+        {
+            tlsf_remove(chunk);
+        }
+        if (!run)
+        {
+            run = chunk;
+            continue;
+        }
+
+        run->size += chunk->size;
+        run->next_phys = next;
+        if (next)
+        {
+            next->prev_phys = run;
+        }
+        release_chunk(chunk);
+    }
+
+    if (run)
+    {
+        tlsf_insert(run);
+    }
+    if (!GC_GENERATIONAL)
+    {
+        memset(segment->marks, 0, HEAP_MARK_WORDS(segment->size) * sizeof(uint64_t));
+    }
+}
+
+static void sweep_slab(segment_t *slab)
+{
+    slab->unswept = false;
+
+    bool was_full = slab->used_count == slab->capacity;
+    for (size_t word = 0; word < slab->capacity / 64; word++)
+    {
+        uint64_t dead = slab->used[word] & ~slab->marks[word];
+        if (dead)
+        {
+            slab->used[word] &= ~dead;
+            if (gc_kinds_used)
+            {
+                // lazy sweeping runs alongside tcache_free, which clears these without the lock
+                __atomic_fetch_and(&slab->typed[word], ~dead, __ATOMIC_RELAXED);
+                __atomic_fetch_and(&slab->atomic[word], ~dead, __ATOMIC_RELAXED);
+            }
+            slab->used_count -= __builtin_popcountll(dead);
+            if (word < slab->first_free_word)
+            {
+                slab->first_free_word = word;
+            }
+        }
+    }
+    if (!GC_GENERATIONAL)
+    {
+        memset(slab->marks, 0, (slab->capacity / 64) * sizeof(uint64_t));
+    }
+
+    if (was_full && slab->used_count < slab->capacity)
+    {
+        link_partial_slab(slab);
+    }
+}
+
+// the first heap segment still waiting for its sweep, or NULL
+static segment_t *next_unswept_heap()
+{
+    while (unswept_heap && !unswept_heap->unswept)
+    {
+        unswept_heap = unswept_heap->next_unswept;
+    }
+    return unswept_heap;
+}
+
+// the first slab of bin still waiting for its sweep, or NULL
+static segment_t *next_unswept_slab(bin_t *bin)
+{
+    while (bin->unswept_slabs && !bin->unswept_slabs->unswept)
+    {
+        bin->unswept_slabs = bin->unswept_slabs->next_unswept;
+    }
+    return bin->unswept_slabs;
+}
+
+// sweeps pending segments until at least budget bytes of them are done, returns true while some remain
+static bool sweep_pending(size_t budget)
+{
+    size_t swept = 0;
+    size_t bin = 0;
+
+    while (swept < budget)
+    {
+        segment_t *segment = next_unswept_heap();
+        while (!segment && bin < BIN_COUNT && !(segment = next_unswept_slab(&bins[bin])))
+        {
+            bin++;
+        }
+        if (!segment)
+        {
+            return false;
+        }
+
+        swept += segment->size;
+        if (segment->kind == SEGMENT_HEAP)
+        {
+            sweep_heap_segment(segment);
+        }
+        else
+        {
+            sweep_slab(segment);
+        }
+    }
+
+    if (next_unswept_heap())
+    {
+        return true;
+    }
+    for (; bin < BIN_COUNT; bin++)
+    {
+        if (next_unswept_slab(&bins[bin]))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// frees dead large objects right away; heap segments and slabs are swept now or, with GC_LAZY_SWEEP, left pending;
+// with GC_GENERATIONAL marks survive the sweep, they are what makes an object old, and sweeping is never lazy
+static void sweep()
+{
+    for (segment_t *segment = segment_list, *next; segment; segment = next)
+    {
+        next = segment->next;
+        if (segment->kind == SEGMENT_LARGE)
+        {
+            if (!segment->mark)
+            {
+                large_free(segment);
+            }
+            else if (!GC_GENERATIONAL)
+            {
+                segment->mark = false;
+            }
+            continue;
+        }
+
+        if (segment->kind != SEGMENT_HEAP && segment->kind != SEGMENT_SLAB)
+        {
+            continue;
+        }
+
+        if (!GC_LAZY_SWEEP || GC_GENERATIONAL)
+        {
+            if (segment->kind == SEGMENT_HEAP)
+            {
+                sweep_heap_segment(segment);
+            }
+            else
+            {
+                sweep_slab(segment);
+            }
+        }
+        else if (segment->kind == SEGMENT_HEAP)
+        {
+            segment->unswept = true;
+            segment->next_unswept = unswept_heap;
+            unswept_heap = segment;
+        }
+        else
+        {
+            segment->unswept = true;
+            segment->next_unswept = segment->bin->unswept_slabs;
+            segment->bin->unswept_slabs = segment;
+        }
+    }
+}
+
+bool gc_sweep_step(size_t budget)
+{
+    pthread_mutex_lock(&heap_lock);
+    bool remaining = sweep_pending(budget);
+    pthread_mutex_unlock(&heap_lock);
+    return remaining;
+}
+
+void gc_card_mark(void *slot, void *value)
+{
+    segment_t *segment = GC_GENERATIONAL ? segment_for_ptr(slot) : NULL;
+    if (segment && (uint8_t *)slot >= segment->memory && (uint8_t *)slot < segment->memory + segment->size)
+    {
+        if (segment->cards)
+        {
+            __atomic_store_n(&segment->cards[CARD_INDEX(segment, slot)], 1, __ATOMIC_RELAXED);
+        }
+        __atomic_store_n(&segment->dirty, true, __ATOMIC_RELAXED);
+    }
+
+    // keep value in a register until the card is dirty, a collection stopping this thread in between still finds it
+    __asm__ __volatile__("" : : "r"(value) : "memory");
+}
+
+static void update_pacing(bool full)
+{
+    size_t marked = 0;
+    for (size_t marker = 0; marker < GC_MARK_THREADS; marker++)
+    {
+        marked += mark_deques[marker].marked_bytes;
+        mark_deques[marker].marked_bytes = 0;
+    }
+
+    // a minor collection only marks the young survivors, the old objects are still there
+    gc_live_bytes = (full ? 0 : gc_live_bytes) + marked;
+    size_t trigger = gc_live_bytes / 100 * gc_pacing_ratio;
+    __atomic_store_n(&gc_pacing_trigger, !gc_pacing_ratio ? 0 : trigger > GC_PACING_MIN ? trigger : GC_PACING_MIN,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&gc_allocated_bytes, 0, __ATOMIC_RELAXED);
+}
+
+// sets how many percent of the live heap may be allocated before a collection starts on its own, like GOGC;
+// 0 leaves collecting to the application. Returns the previous ratio
+size_t gc_set_pacing(size_t ratio)
+{
+    pthread_mutex_lock(&heap_lock);
+    size_t previous = gc_pacing_ratio;
+    gc_pacing_ratio = ratio;
+    size_t trigger = gc_live_bytes / 100 * ratio;
+    __atomic_store_n(&gc_pacing_trigger, !ratio ? 0 : trigger > GC_PACING_MIN ? trigger : GC_PACING_MIN,
+                     __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&heap_lock);
+
+    return previous;
+}
+
+// traces whatever is still grey and sweeps, the world must be stopped
+static void finish_collection(bool full)
+{
+    mark_parallel();
+    while (gc_mark_overflowed)
+    {
+        gc_mark_overflowed = false;
+        mark_rescan();
+        mark_parallel();
+    }
+    sweep();
+    if (GC_GENERATIONAL)
+    {
+        unmark_cached_slots();
+        clear_cards();
+    }
+    update_pacing(full);
+}
+
+// ends the marking of an incremental cycle, the world must be stopped
+static void end_marking()
+{
+    // slots freed into thread caches during the cycle may have lost their mark
+    mark_cached_slots();
+    __atomic_store_n(&gc_marking, false, __ATOMIC_RELEASE);
+}
+
+// forgets the marks and grey ranges of an incremental cycle, the world must be stopped
+static void abandon_marking()
+{
+    __atomic_store_n(&gc_marking, false, __ATOMIC_RELEASE);
+    clear_marks();
+    for (size_t marker = 0; marker < GC_MARK_THREADS; marker++)
+    {
+        mark_deques[marker].top = mark_deques[marker].bottom = 0;
+        mark_deques[marker].marked_bytes = 0;
+    }
+    gc_mark_overflowed = false;
+}
+
+static void collect(bool full)
+{
+    // only a collection this thread is already running is skipped, one on another thread is waited for on the locks
+    static __thread bool collecting = false;
+    if (collecting)
+        return;
+    collecting = true;
+
+    pthread_once(&gc_pool_once, gc_start_markers);
+    pthread_once(&gc_thread_once, gc_thread_init);
+    void *stack_top = gc_thread.registered ? gc_thread.stack_top : thread_stack_top();
+
+    // the collector's registers go on its own stack, below every frame that is still live after marking
+    jmp_buf registers;
+    setjmp(registers);
+
+    pthread_mutex_lock(&gc_thread_lock);
+    pthread_mutex_lock(&heap_lock);
+    // the marks of the previous collection must be gone before this one sets its own
+    sweep_pending(SIZE_MAX);
+    size_t stopped = stop_world();
+    // a running incremental cycle is dropped rather than finished: what it allocated black may be garbage by now.
+    // full itself is never written after setjmp, which -Wclobbered rightly warns about
+    bool abandoned = gc_marking;
+    if (abandoned)
+    {
+        abandon_marking();
+    }
+    bool full_collection = full || abandoned;
+    if (GC_GENERATIONAL && full_collection)
+    {
+        clear_marks();
+    }
+    mark_roots((void **)&registers, (void **)stack_top, !full_collection);
+    finish_collection(full_collection);
+    resume_world(stopped);
+    pthread_mutex_unlock(&heap_lock);
+    pthread_mutex_unlock(&gc_thread_lock);
+
+    collecting = false;
+}
+
+// runs an incremental collection in slices: the first call stops the world just long enough to scan the roots,
+// each later one marks about max_work bytes while the other threads keep running, and the one that runs out of
+// grey objects stops the world again to finish marking and sweep; returns false once the cycle is over, even
+// when an allocation assist or a collection finished it, and only the call after that starts a new one.
+// gc_write_barrier keeps a snapshot-at-the-beginning invariant meanwhile: every object reachable when the roots
+// were scanned is marked, and objects allocated since are born marked
+bool gc_step(size_t max_work)
+{
+    return step(max_work, true, &gc_stepped_cycle);
+}
+
+// an assist only advances a running cycle, it never starts one; a caller that passes cycle only advances the
+// cycle it holds there, which is 0 once that one is over
+static bool step(size_t max_work, bool start, size_t *cycle)
+{
+    pthread_once(&gc_pool_once, gc_start_markers);
+    pthread_once(&gc_thread_once, gc_thread_init);
+    void *stack_top = gc_thread.registered ? gc_thread.stack_top : thread_stack_top();
+
+    jmp_buf registers;
+    setjmp(registers);
+
+    pthread_mutex_lock(&gc_thread_lock);
+    pthread_mutex_lock(&heap_lock);
+    bool marking = gc_marking;
+    if (cycle && *cycle && (!marking || *cycle != gc_incremental_cycles))
+    {
+        // someone else finished the cycle this caller was driving
+        marking = false;
+    }
+    else if (!marking && !start)
+    {
+        // the cycle ended while this thread waited for the locks
+    }
+    else if (!marking)
+    {
+        sweep_pending(SIZE_MAX);
+        size_t stopped = stop_world();
+        if (GC_GENERATIONAL)
+        {
+            clear_marks();
+        }
+        gc_snapshot_roots = true;
+        mark_roots((void **)&registers, (void **)stack_top, false);
+        gc_snapshot_roots = false;
+        gc_scanned_words = 0;
+        gc_incremental_cycles++;
+        __atomic_store_n(&gc_marking, true, __ATOMIC_RELEASE);
+        resume_world(stopped);
+        marking = true;
+    }
+    else
+    {
+        // the heap lock is let go every GC_ASSIST_WORK bytes, so a long slice does not hold up the mutators' refills;
+        // the cycle cannot end meanwhile, that takes gc_thread_lock
+        size_t budget = max_work / sizeof(void *) + 1;
+        for (;;)
+        {
+            size_t piece = budget < GC_ASSIST_WORK / sizeof(void *) ? budget : GC_ASSIST_WORK / sizeof(void *);
+            size_t done = mark_step(piece);
+            gc_scanned_words += done;
+            budget -= done < budget ? done : budget;
+            if (!budget || done < piece)
+            {
+                break;
+            }
+            pthread_mutex_unlock(&heap_lock);
+            pthread_mutex_lock(&heap_lock);
+        }
+        if (!mark_work_available())
+        {
+            // only what the write barrier shaded since can still be grey
+            size_t stopped = stop_world();
+            end_marking();
+            finish_collection(true);
+            resume_world(stopped);
+            marking = false;
+        }
+    }
+    if (cycle)
+    {
+        *cycle = marking ? gc_incremental_cycles : 0;
+    }
+    pthread_mutex_unlock(&heap_lock);
+    pthread_mutex_unlock(&gc_thread_lock);
+
+    return marking;
+}
+
+bool gc_get_progress(size_t *scanned_bytes, size_t *pending_bytes)
+{
+    bool marking = __atomic_load_n(&gc_marking, __ATOMIC_ACQUIRE);
+    *scanned_bytes = marking ? __atomic_load_n(&gc_scanned_words, __ATOMIC_RELAXED) * sizeof(void *) : 0;
+    *pending_bytes = 0;
+
+    for (size_t marker = 0; marking && marker < gc_markers; marker++)
+    {
+        mark_deque_t *deque = &mark_deques[marker];
+        pthread_mutex_lock(&deque->lock);
+        for (size_t i = deque->top; i < deque->bottom; i++)
+        {
+            *pending_bytes += (uint8_t *)deque->items[i].end - (uint8_t *)deque->items[i].start;
+        }
+        pthread_mutex_unlock(&deque->lock);
+    }
+
+    return marking;
+}
+
+// the write barrier behind gc_write_barrier: while an incremental cycle is marking, the value being overwritten
+// is shaded grey so nothing reachable from the root snapshot is lost; the store runs as one step with respect to
+// stopping the world, so a cycle cannot start or end between the check and the store
+void gc_write(void **slot, void *value)
+{
+    barrier_enter();
+    if (__atomic_load_n(&gc_marking, __ATOMIC_ACQUIRE))
+    {
+        mark_word(0, *slot);
+    }
+    *slot = value;
+    gc_card_mark(slot, value);
+    barrier_exit();
+}
+
+// objects allocated while an incremental cycle is marking are born marked, the root snapshot never saw them
+static inline void allocate_black(void *ptr)
+{
+    if (__atomic_load_n(&gc_marking, __ATOMIC_RELAXED) && ptr)
+    {
+        void *start;
+        const gc_type_t *type;
+        barrier_enter();
+        if (__atomic_load_n(&gc_marking, __ATOMIC_ACQUIRE))
+        {
+            mark_allocation(ptr, &start, &type);
+        }
+        barrier_exit();
+    }
+}
+
+// a copy hands pointers from one object to another behind the write barrier's back, and the source may be freed
+// before the cycle scans it; the copy, born marked, is queued grey so what it holds is still traced
+static inline void shade_copy(void *ptr, size_t size, const gc_type_t *type)
+{
+    if (__atomic_load_n(&gc_marking, __ATOMIC_RELAXED) && (!type || type->pointers))
+    {
+        barrier_enter();
+        if (__atomic_load_n(&gc_marking, __ATOMIC_ACQUIRE) &&
+            !mark_push(0, (void **)ptr, (void **)ptr + size / sizeof(void *), type))
+        {
+            // it is marked, mark_rescan finds it again
+            __atomic_store_n(&gc_mark_overflowed, true, __ATOMIC_RELAXED);
+        }
+        barrier_exit();
+    }
+}
+
+// an allocation that leaves the thread cache pays for a slice of the running incremental cycle, or starts a
+// collection once enough has been allocated since the last. The background collector of GC_CONCURRENT marks on
+// its own until the mutators have allocated GC_CONCURRENT_HEADROOM percent of the trigger during the cycle, then
+// they help it too, so they cannot outrun it
+static inline void gc_assist()
+{
+    size_t allocated = __atomic_load_n(&gc_allocated_bytes, __ATOMIC_RELAXED);
+    size_t trigger = __atomic_load_n(&gc_pacing_trigger, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&gc_marking, __ATOMIC_RELAXED))
+    {
+        if (!GC_CONCURRENT || allocated >= (trigger ? trigger : GC_PACING_MIN) / 100 * GC_CONCURRENT_HEADROOM)
+        {
+            step(GC_ASSIST_WORK, false, NULL);
+        }
+        return;
+    }
+
+    // whoever resets the count starts the collection, the others keep allocating
+    if (trigger && allocated >= trigger &&
+        __atomic_compare_exchange_n(&gc_allocated_bytes, &allocated, 0, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+        gc_collect();
+    }
+}
+
+// marks in slices of GC_CONCURRENT_SLICE bytes, letting go of the heap lock in between so the mutators can
+// refill their caches; only the root snapshot and the final remark and sweep stop the world
+static void *gc_collector_main(void *arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&gc_collector_lock);
+    for (;;)
+    {
+        while (!gc_collect_requested)
+        {
+            pthread_cond_wait(&gc_collector_wake, &gc_collector_lock);
+        }
+        gc_collect_requested = false;
+        pthread_mutex_unlock(&gc_collector_lock);
+
+        // the first step joins a cycle started by gc_step rather than starting another
+        bool marking = step(GC_CONCURRENT_SLICE, true, NULL);
+        while (marking)
+        {
+            sched_yield();
+            marking = step(GC_CONCURRENT_SLICE, false, NULL);
+        }
+
+        pthread_mutex_lock(&gc_collector_lock);
+    }
+
+    return NULL;
+}
+
+static void gc_start_collector()
+{
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, gc_collector_main, NULL) == 0)
+    {
+        pthread_detach(thread);
+        gc_collector_running = true;
+    }
+}
+
+// with GC_GENERATIONAL only every GC_FULL_INTERVAL-th collection is full, the others are minor;
+// with GC_CONCURRENT the background collector runs a full cycle and gc_collect returns right away
+void gc_collect()
+{
+    if (GC_CONCURRENT)
+    {
+        pthread_once(&gc_collector_once, gc_start_collector);
+        if (gc_collector_running)
+        {
+            pthread_mutex_lock(&gc_collector_lock);
+            gc_collect_requested = true;
+            pthread_cond_signal(&gc_collector_wake);
+            pthread_mutex_unlock(&gc_collector_lock);
+            return;
+        }
+    }
+    collect(!GC_GENERATIONAL || ++gc_collections % GC_FULL_INTERVAL == 0);
+}
+
+void *gc_alloc_typed(size_t size, alignment_t alignment, const gc_type_t *type)
+{
+    // a layout the marker cannot step through is ignored, and the object scanned conservatively
+    if (type && (!type->size || type->size % sizeof(void *)))
+    {
+        type = NULL;
+    }
+    else if (type && !type->pointers)
+    {
+        type = &gc_atomic_type;
+    }
+
+    void *ptr = alloc_typed(size, alignment, type);
+    if (!ptr && size && type)
+    {
+        // out of memory, the garbage may make room; without a type heap_alloc has tried that already
+        gc_collect_full();
+        ptr = alloc_typed(size, alignment, type);
+    }
+    return ptr;
+}
+
+// for pointer-free data such as strings and numeric arrays, which the collector never scans
+void *gc_alloc_atomic(size_t size, alignment_t alignment)
+{
+    return gc_alloc_typed(size, alignment, &gc_atomic_type);
+}
+
+void gc_collect_full()
+{
+    collect(true);
+}
+
+#endif
+
+static inline alignment_t calculate_alignment(const void *ptr)
+{
+    uintptr_t addr = (uintptr_t)ptr;
+    size_t alignment = ALIGN_1;
+
+    while (alignment <= MAX_ALIGNMENT && !(addr & (alignment - 1)))
+    {
+        alignment = (alignment << 1);
+    }
+
+    return (alignment_t)(alignment >> 1);
+}
+
+// maps a segment with room for a header of header_size bytes ahead of at least usable_size bytes;
+// the caller fills in the kind specific fields and then registers it
+static segment_t *map_segment(segment_kind_t kind, size_t header_size, size_t usable_size)
+{
+    header_size = ALIGN_UP(header_size, MAX_ALIGNMENT_INT);
+    size_t mapped_size = ALIGN_UP(header_size + usable_size, HEAP_PAGE_SIZE);
+    void *base = mmap(NULL, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    segment_t *segment = base;
+    segment->memory = (uint8_t *)base + header_size;
+    segment->size = mapped_size - header_size;
+    segment->mapped_size = mapped_size;
+    segment->kind = kind;
+    return segment;
+}
+
+// points every page of the segment at it in the page map, must be called with heap_lock held
+static bool register_segment(segment_t *segment)
+{
+    if (!page_map)
+    {
+        return false;
+    }
+
+    for (uint8_t *page = (uint8_t *)segment; page < (uint8_t *)segment + segment->mapped_size; page += HEAP_PAGE_SIZE)
+    {
+        segment_t **leaf = page_map[PAGE_MAP_ROOT(page)];
+        if (!leaf)
+        {
+            leaf = mmap(NULL, sizeof(segment_t *) << PAGE_MAP_LEAF_BITS, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if (leaf == MAP_FAILED)
+            {
+                return false;
+            }
+            __atomic_store_n(&page_map[PAGE_MAP_ROOT(page)], leaf, __ATOMIC_RELEASE);
+        }
+        __atomic_store_n(&leaf[PAGE_MAP_LEAF(page)], segment, __ATOMIC_RELEASE);
+    }
+
+    // the span only grows, so a word it rules out can never point at an allocation
+    if (segment->kind != SEGMENT_CHUNK_POOL)
+    {
+        if ((uintptr_t)segment < segment_span_low)
+        {
+            __atomic_store_n(&segment_span_low, (uintptr_t)segment, __ATOMIC_RELAXED);
+        }
+        if ((uintptr_t)segment + segment->mapped_size > segment_span_high)
+        {
+            __atomic_store_n(&segment_span_high, (uintptr_t)segment + segment->mapped_size, __ATOMIC_RELAXED);
+        }
+    }
+
+    segment->prev = NULL;
+    segment->next = segment_list;
+    if (segment_list)
+    {
+        segment_list->prev = segment;
+    }
+    segment_list = segment;
+    return true;
+}
+
+// removes the segment from the page map and the segment list, must be called with heap_lock held
+static void unregister_segment(segment_t *segment)
+{
+    for (uint8_t *page = (uint8_t *)segment; page < (uint8_t *)segment + segment->mapped_size; page += HEAP_PAGE_SIZE)
+    {
+        __atomic_store_n(&page_map[PAGE_MAP_ROOT(page)][PAGE_MAP_LEAF(page)], NULL, __ATOMIC_RELEASE);
+    }
+
+    if (segment->prev)
+    {
+        segment->prev->next = segment->next;
+    }
+    else
+    {
+        segment_list = segment->next;
+    }
+    if (segment->next)
+    {
+        segment->next->prev = segment->prev;
+    }
+}
+
+// returns the segment whose usable memory holds ptr, or NULL; safe to call without heap_lock
+static inline segment_t *segment_for_ptr(const void *ptr)
+{
+    segment_t ***root = __atomic_load_n(&page_map, __ATOMIC_ACQUIRE);
+    if (!root || PAGE_MAP_ROOT(ptr) >> PAGE_MAP_ROOT_BITS)
+    {
+        return NULL;
+    }
+
+    segment_t **leaf = __atomic_load_n(&root[PAGE_MAP_ROOT(ptr)], __ATOMIC_ACQUIRE);
+    segment_t *segment = leaf ? __atomic_load_n(&leaf[PAGE_MAP_LEAF(ptr)], __ATOMIC_ACQUIRE) : NULL;
+    if (!segment || (const uint8_t *)ptr < segment->memory || (const uint8_t *)ptr >= segment->memory + segment->size)
+    {
+        return NULL;
+    }
+    return segment;
+}
+
+static metadata_t *new_chunk(void *chunk_ptr, size_t size)
+{
+    if (!unused_chunks)
+    {
+        // pools are registered so a header word can be checked to point at a real node
+        segment_t *pool = map_segment(SEGMENT_CHUNK_POOL, sizeof(segment_t), CHUNK_POOL_GROWTH * sizeof(metadata_t));
+        if (!pool)
+        {
+            return NULL;
+        }
+        if (!register_segment(pool))
+        {
+            munmap(pool, pool->mapped_size);
+            return NULL;
+        }
+
+        metadata_t *nodes = (metadata_t *)pool->memory;
+        size_t count = pool->size / sizeof(metadata_t);
+        for (size_t i = 0; i < count; i++)
+        {
+            release_chunk(&nodes[count - 1 - i]);
+        }
+    }
+
+    metadata_t *chunk = unused_chunks;
+    unused_chunks = chunk->next_free;
+    *chunk = (metadata_t){
+        .chunk_ptr = chunk_ptr,
+        .data_ptr = chunk_ptr,
+        .size = size,
+        .usable_size = size,
+        .current_alignment = calculate_alignment(chunk_ptr),
+        .alloc_type = ALLOC_TYPE_HEAP};
+    return chunk;
+}
+
+static void release_chunk(metadata_t *chunk)
+{
+    chunk->data_ptr = NULL;
+    chunk->next_free = unused_chunks;
+    unused_chunks = chunk;
+}
+
+static inline void tlsf_mapping(size_t size, size_t *fl, size_t *sl)
+{
+    if (size < TLSF_SMALL_BLOCK)
+    {
+        *fl = 0;
+        *sl = size >> TLSF_GRANULE_LOG2;
+        return;
+    }
+
+    size_t log2 = 63 - __builtin_clzll(size);
+    *sl = (size >> (log2 - TLSF_SL_LOG2)) ^ TLSF_SL_COUNT;
+    *fl = log2 - TLSF_FL_SHIFT + 1;
+}
+
+// rounds size up to the next list boundary, so every chunk in that list or above is large enough
+static inline size_t tlsf_round_up(size_t size)
+{
+    if (size >= TLSF_SMALL_BLOCK)
+    {
+        size += ((size_t)1 << (63 - __builtin_clzll(size) - TLSF_SL_LOG2)) - 1;
+    }
+    return size;
+}
+
+static void tlsf_insert(metadata_t *chunk)
+{
+    size_t fl, sl;
+    tlsf_mapping(chunk->size, &fl, &sl);
+
+    chunk->is_free = true;
+    chunk->data_ptr = chunk->chunk_ptr;
+    chunk->usable_size = chunk->size;
+    chunk->current_alignment = calculate_alignment(chunk->chunk_ptr);
+
+    chunk->prev_free = NULL;
+    chunk->next_free = tlsf_free_lists[fl][sl];
+    if (chunk->next_free)
+    {
+        chunk->next_free->prev_free = chunk;
+    }
+    tlsf_free_lists[fl][sl] = chunk;
+    tlsf_fl_bitmap |= (1ULL << fl);
+    tlsf_sl_bitmap[fl] |= (1U << sl);
+}
+
+static void tlsf_remove(metadata_t *chunk)
+{
+    size_t fl, sl;
+    tlsf_mapping(chunk->size, &fl, &sl);
+
+    if (chunk->prev_free)
+    {
+        chunk->prev_free->next_free = chunk->next_free;
+    }
+    else
+    {
+        tlsf_free_lists[fl][sl] = chunk->next_free;
+        if (!tlsf_free_lists[fl][sl])
+        {
+            tlsf_sl_bitmap[fl] &= ~(1U << sl);
+            if (!tlsf_sl_bitmap[fl])
+            {
+                tlsf_fl_bitmap &= ~(1ULL << fl);
+            }
+        }
+    }
+    if (chunk->next_free)
+    {
+        chunk->next_free->prev_free = chunk->prev_free;
+    }
+
+    chunk->is_free = false;
+    chunk->prev_free = chunk->next_free = NULL;
+}
+
+// good fit: any chunk in the first non-empty list at or above the rounded size is large enough
+static metadata_t *tlsf_find(size_t size)
+{
+    size_t fl, sl;
+    tlsf_mapping(tlsf_round_up(size), &fl, &sl);
+    if (fl >= TLSF_FL_COUNT)
+    {
+        return NULL;
+    }
+
+    uint32_t sl_map = tlsf_sl_bitmap[fl] & (~0U << sl);
+    if (!sl_map)
+    {
+        uint64_t fl_map = tlsf_fl_bitmap & (~0ULL << fl) & ~(1ULL << fl);
+        if (!fl_map)
+        {
+            return NULL;
+        }
+        fl = __builtin_ctzll(fl_map);
+        sl_map = tlsf_sl_bitmap[fl];
+    }
+
+    return tlsf_free_lists[fl][__builtin_ctz(sl_map)];
+}
+
+// shrinks chunk to size and returns the detached remainder, or NULL if it was too small to split off
+static metadata_t *split_chunk(metadata_t *chunk, size_t size)
+{
+    size_t remaining = chunk->size - size;
+    if (remaining < SPLIT_CUTOFF)
+    {
+        return NULL;
+    }
+
+    metadata_t *rest = new_chunk((uint8_t *)chunk->chunk_ptr + size, remaining);
+    if (!rest)
+    {
+        return NULL;
+    }
+
+    rest->prev_phys = chunk;
+    rest->next_phys = chunk->next_phys;
+    if (rest->next_phys)
+    {
+        rest->next_phys->prev_phys = rest;
+    }
+    chunk->next_phys = rest;
+    chunk->size = size;
+    return rest;
+}
+
+// maps a new heap segment holding at least size bytes and returns its single free chunk
+static metadata_t *grow_heap(size_t size)
+{
+    size = ALIGN_UP(size > HEAP_SEGMENT_SIZE ? size : HEAP_SEGMENT_SIZE, HEAP_PAGE_SIZE);
+    size_t mark_words = HEAP_MARK_WORDS(size);
+    size_t start_words = GC_INTERIOR_POINTERS ? mark_words + ALIGN_UP(mark_words, 64) / 64 : 0;
+    segment_t *segment = map_segment(SEGMENT_HEAP,
+                                     sizeof(segment_t) + (mark_words + start_words) * sizeof(uint64_t) + CARD_COUNT(size),
+                                     size);
+    if (!segment)
+    {
+        return NULL;
+    }
+    segment->size = size; // the mark and start bitmaps and the cards cover exactly this much
+    segment->marks = (uint64_t *)(segment + 1);
+    segment->starts = GC_INTERIOR_POINTERS ? segment->marks + mark_words : NULL;
+    segment->start_words = GC_INTERIOR_POINTERS ? segment->starts + mark_words : NULL;
+    segment->cards = GC_GENERATIONAL ? (uint8_t *)(segment->marks + mark_words + start_words) : NULL;
+
+    metadata_t *chunk = new_chunk(segment->memory, segment->size);
+    if (!chunk)
+    {
+        munmap(segment, segment->mapped_size);
+        return NULL;
+    }
+
+    if (!register_segment(segment))
+    {
+        release_chunk(chunk);
+        munmap(segment, segment->mapped_size);
+        return NULL;
+    }
+    segment->first_chunk = chunk;
+    tlsf_insert(chunk);
+    return chunk;
+}
+
+// merges chunk, which must not be in the TLSF index, with its free neighbours and files the result
+static metadata_t *coalesce_chunk(metadata_t *chunk)
+{
+    metadata_t *prev = chunk->prev_phys;
+    if (prev && prev->is_free)
+    {
+        tlsf_remove(prev);
+        prev->size += chunk->size;
+        prev->next_phys = chunk->next_phys;
+        if (prev->next_phys)
+        {
+            prev->next_phys->prev_phys = prev;
+        }
+        release_chunk(chunk);
+        chunk = prev;
+    }
+
+    metadata_t *next = chunk->next_phys;
+    if (next && next->is_free)
+    {
+        tlsf_remove(next);
+        chunk->size += next->size;
+        chunk->next_phys = next->next_phys;
+        if (chunk->next_phys)
+        {
+            chunk->next_phys->prev_phys = chunk;
+        }
+        release_chunk(next);
+    }
+
+    tlsf_insert(chunk);
+    return chunk;
+}
+
+static void defragment_heap()
+{
+    for (segment_t *segment = segment_list; segment; segment = segment->next)
+    {
+        if (segment->kind != SEGMENT_HEAP)
+        {
+            continue;
+        }
+
+        for (metadata_t *chunk = segment->first_chunk; chunk; chunk = chunk->next_phys)
+        {
+            if (!chunk->is_free || !chunk->next_phys || !chunk->next_phys->is_free)
+            {
+                continue;
+            }
+
+            tlsf_remove(chunk);
+            while (chunk->next_phys && chunk->next_phys->is_free)
+            {
+                metadata_t *next = chunk->next_phys;
+                tlsf_remove(next);
+                chunk->size += next->size;
+                chunk->next_phys = next->next_phys;
+                if (chunk->next_phys)
+                {
+                    chunk->next_phys->prev_phys = chunk;
+                }
+                release_chunk(next);
+            }
+            tlsf_insert(chunk);
+        }
+    }
+}
+
+static void heap_init_once()
+{
+    // slabs start MAX_ALIGNMENT aligned, so a slot is aligned to the largest power of two dividing its size
+    for (size_t align_log2 = 0; align_log2 < 7; align_log2++)
+    {
+        size_t index = 0;
+        for (size_t step = 0; step <= (SIZE_CLASS_MAX >> 3); step++)
+        {
+            while (bins[index].slot_size < (step << 3) || (bins[index].slot_size & ((1 << align_log2) - 1)))
+            {
+                index++;
+            }
+            size_class_lookup[align_log2][step] = index;
+        }
+    }
+
+    // reserve address space only; pages are committed as segments are registered
+    segment_t ***root = mmap(NULL, sizeof(segment_t **) << PAGE_MAP_ROOT_BITS, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (root != MAP_FAILED)
+    {
+        __atomic_store_n(&page_map, root, __ATOMIC_RELEASE);
+    }
+
+    // odd, and different in every process with address space randomization
+    tcache_cookie = ((uintptr_t)root ^ (uintptr_t)&root) * 0x9e3779b97f4a7c15ULL | 1;
+}
+
+void heap_init()
+{
+    static pthread_once_t has_run = PTHREAD_ONCE_INIT;
+    pthread_once(&has_run, heap_init_once);
+
+#ifdef GC_COLLECT
+    gc_register_thread();
+#endif
+}
+
+// returns the bin serving size at alignment, or BIN_COUNT when it belongs on the heap
+static inline size_t size_class_for(size_t size, alignment_t alignment)
+{
+    if (size > SIZE_CLASS_MAX)
+    {
+        return BIN_COUNT;
+    }
+    return size_class_lookup[__builtin_ctz(alignment)][(size + 7) >> 3];
+}
+
+// true when ptr is the start of a slot in slab, which it must lie within
+static bool slab_slot(segment_t *slab, void *ptr, size_t *slot)
+{
+    size_t offset = (uint8_t *)ptr - slab->memory;
+    if (offset % slab->slot_size)
+    {
+        return false;
+    }
+    *slot = offset / slab->slot_size;
+    return true;
+}
+
+// returns the slab owning ptr and its slot index, or NULL when ptr is not the start of a bin slot
+static segment_t *slab_for_ptr(void *ptr, size_t *slot)
+{
+    segment_t *segment = segment_for_ptr(ptr);
+    if (!segment || segment->kind != SEGMENT_SLAB || !slab_slot(segment, ptr, slot))
+    {
+        return NULL;
+    }
+    return segment;
+}
+
+// the layout of an allocated slot, NULL when it is scanned conservatively
+static inline const gc_type_t *slab_slot_type(segment_t *slab, size_t slot)
+{
+    if (BITMAP_TEST(slab->atomic, slot))
+    {
+        return &gc_atomic_type;
+    }
+    if (__atomic_load_n(&slab->typed[slot / 64], __ATOMIC_ACQUIRE) & (1ULL << (slot % 64)))
+    {
+        return ((const gc_type_t **)(slab->memory + (slot + 1) * slab->slot_size))[-1];
+    }
+    return NULL;
+}
+
+static void link_partial_slab(segment_t *slab)
+{
+    bin_t *bin = slab->bin;
+    slab->prev_partial = NULL;
+    slab->next_partial = bin->partial_slabs;
+    if (bin->partial_slabs)
     {
-        target_free_array = free_bin_16;
-        target_alloc_array = alloc_bin_16;
-        target_free_size = &free_bin_16_size;
-        target_alloc_size = &alloc_bin_16_size;
-        target_capacity = BIN_16_CAPACITY;
-        size = BIN_16_SIZE;
-        alloc_type = ALLOC_TYPE_BIN_16;
+        bin->partial_slabs->prev_partial = slab;
     }
-    else if (size <= BIN_32_SIZE)
+    bin->partial_slabs = slab;
+}
+
+static void unlink_partial_slab(segment_t *slab)
+{
+    if (slab->prev_partial)
     {
-        target_free_array = free_bin_32;
-        target_alloc_array = alloc_bin_32;
-        target_free_size = &free_bin_32_size;
-        target_alloc_size = &alloc_bin_32_size;
-        target_capacity = BIN_32_CAPACITY;
-        size = BIN_32_SIZE;
-        alloc_type = ALLOC_TYPE_BIN_32;
+        slab->prev_partial->next_partial = slab->next_partial;
     }
     else
     {
-        ssize_t best_fit_index = search_by_size_in_free_array(size, alignment);
-        if (best_fit_index < 0)
+        slab->bin->partial_slabs = slab->next_partial;
+    }
+    if (slab->next_partial)
+    {
+        slab->next_partial->prev_partial = slab->prev_partial;
+    }
+    slab->prev_partial = slab->next_partial = NULL;
+}
+
+// reads the header word in front of ptr, which lies in the heap segment, and checks it names a live chunk
+static metadata_t *find_allocation(segment_t *segment, void *ptr)
+{
+    if (((uintptr_t)ptr & (ALIGN_8 - 1)) || (uint8_t *)ptr < segment->memory + CHUNK_HEADER_SIZE)
+    {
+        return NULL;
+    }
+
+    metadata_t *chunk = ((metadata_t **)ptr)[-1];
+    segment_t *pool = segment_for_ptr(chunk);
+    if (!pool || pool->kind != SEGMENT_CHUNK_POOL || ((uint8_t *)chunk - pool->memory) % sizeof(metadata_t))
+    {
+        return NULL;
+    }
+
+    return chunk->data_ptr == ptr && !chunk->is_free ? chunk : NULL;
+}
+
+void *heap_alloc(size_t size, alignment_t alignment)
+{
+    void *ptr = alloc_once(size, alignment);
+#ifdef GC_COLLECT
+    if (!ptr && size)
+    {
+        // out of memory: collect synchronously, even with GC_CONCURRENT, and try once more
+        gc_collect_full();
+        ptr = alloc_once(size, alignment);
+    }
+#endif
+
+    return ptr;
+}
+
+static void *alloc_once(size_t size, alignment_t alignment)
+{
+    if (!size)
+    {
+        return NULL;
+    }
+
+    heap_init();
+
+    if (!alignment || ((alignment) & (alignment - 1)) || (alignment > MAX_ALIGNMENT))
+    {
+        alignment = DEFAULT_ALIGNMENT;
+    }
+
+    size_t bin = size_class_for(size, alignment);
+    if (bin < BIN_COUNT)
+    {
+        return tcache_alloc(bin);
+    }
+
+#ifdef GC_COLLECT
+    gc_assist();
+#endif
+    if (size >= LARGE_OBJECT_THRESHOLD)
+    {
+        return large_alloc(size);
+    }
+
+    pthread_mutex_lock(&heap_lock);
+    void *data_ptr = heap_alloc_chunk(size, alignment);
+    pthread_mutex_unlock(&heap_lock);
+
+    return data_ptr;
+}
+
+// allocates like heap_alloc and records the layout the collector scans the object with, NULL for every word;
+// a typed slot needs a word of its own for the layout, so it may take a larger class
+static void *alloc_typed(size_t size, alignment_t alignment, const gc_type_t *type)
+{
+    if (!type || !size)
+    {
+        return heap_alloc(size, alignment);
+    }
+
+    heap_init();
+    __atomic_store_n(&gc_kinds_used, true, __ATOMIC_RELAXED);
+
+    if (!alignment || ((alignment) & (alignment - 1)) || (alignment > MAX_ALIGNMENT))
+    {
+        alignment = DEFAULT_ALIGNMENT;
+    }
+
+    size_t trailer = type != &gc_atomic_type ? sizeof(void *) : 0;
+    size_t bin = size_class_for(size + trailer, alignment);
+    if (bin < BIN_COUNT)
+    {
+        void *ptr = tcache_alloc(bin);
+        if (!ptr)
         {
             return NULL;
         }
 
-        metadata_t *chunk = &free_array[best_fit_index];
-        size_t padding = ((alignment - (size_t)chunk->chunk_ptr) & (alignment - 1));
-        void *data_ptr = (uint8_t *)chunk->chunk_ptr + padding;
+        segment_t *slab = segment_for_ptr(ptr);
+        size_t slot = BIN_SLOT(slab, ptr);
+        if (trailer)
+        {
+            ((const gc_type_t **)((uint8_t *)ptr + slab->slot_size))[-1] = type;
+            __atomic_fetch_or(&slab->typed[slot / 64], 1ULL << (slot % 64), __ATOMIC_RELEASE);
+        }
+        else
+        {
+            __atomic_fetch_or(&slab->atomic[slot / 64], 1ULL << (slot % 64), __ATOMIC_RELAXED);
+        }
+        return ptr;
+    }
+
+#ifdef GC_COLLECT
+    gc_assist();
+#endif
+    if (size >= LARGE_OBJECT_THRESHOLD)
+    {
+        void *ptr = large_alloc(size);
+        if (ptr)
+        {
+            segment_for_ptr(ptr)->gc_type = type;
+        }
+        return ptr;
+    }
+
+    pthread_mutex_lock(&heap_lock);
+    void *data_ptr = heap_alloc_chunk(size, alignment);
+    if (data_ptr)
+    {
+        ((metadata_t **)data_ptr)[-1]->gc_type = type;
+    }
+    pthread_mutex_unlock(&heap_lock);
+
+    return data_ptr;
+}
+
+// finds a free chunk of at least size bytes, sweeping a pending segment before carving memory out of it
+static metadata_t *heap_find_chunk(size_t size)
+{
+#ifdef GC_COLLECT
+    for (;;)
+    {
+        metadata_t *chunk = tlsf_find(size);
+        if (!next_unswept_heap())
+        {
+            return chunk;
+        }
+
+        // without a fit, sweeping may free one up before the heap has to grow
+        segment_t *segment = chunk ? segment_for_ptr(chunk->chunk_ptr) : unswept_heap;
+        if (!segment->unswept)
+        {
+            return chunk;
+        }
+        sweep_heap_segment(segment);
+    }
+#else
+    return tlsf_find(size);
+#endif
+}
+
+static void *heap_alloc_chunk(size_t size, alignment_t alignment)
+{
+    // every chunk starts pointer aligned, so that is the most padding an alignment can need
+    size = ALIGN_UP(size, ALIGN_8) + CHUNK_HEADER_SIZE;
+    size_t worst_padding = alignment > ALIGN_8 ? alignment - ALIGN_8 : 0;
+
+    metadata_t *chunk = heap_find_chunk(size + worst_padding);
+    if (!chunk && !(chunk = grow_heap(tlsf_round_up(size + worst_padding))))
+    {
+        return NULL;
+    }
+    tlsf_remove(chunk);
+
+    size_t padding = ((alignment - (size_t)chunk->chunk_ptr - CHUNK_HEADER_SIZE) & (alignment - 1));
+    if (padding >= SPLIT_CUTOFF)
+    {
+        metadata_t *rest = split_chunk(chunk, padding);
+        if (rest)
+        {
+            tlsf_insert(chunk);
+            chunk = rest;
+            padding = 0;
+        }
+    }
+
+    metadata_t *rest = split_chunk(chunk, padding + size);
+    if (rest)
+    {
+        tlsf_insert(rest);
+    }
+
+    chunk->data_ptr = (uint8_t *)chunk->chunk_ptr + padding + CHUNK_HEADER_SIZE;
+    chunk->usable_size = chunk->size - padding - CHUNK_HEADER_SIZE;
+    chunk->current_alignment = alignment;
+    chunk->gc_type = NULL;
+    ((metadata_t **)chunk->data_ptr)[-1] = chunk;
+    __atomic_fetch_add(&gc_allocated_bytes, chunk->size, __ATOMIC_RELAXED);
+#ifdef GC_COLLECT
+    record_chunk_start(chunk);
+    allocate_black(chunk->data_ptr);
+#endif
+
+    return chunk->data_ptr;
+}
+
+static segment_t *map_slab(bin_t *bin)
+{
+    size_t bitmap_words = bin->slab_capacity / 64;
+    size_t size = bin->slab_capacity * bin->slot_size;
+    segment_t *slab = map_segment(SEGMENT_SLAB, sizeof(segment_t) + 4 * bitmap_words * sizeof(uint64_t) + CARD_COUNT(size),
+                                  size);
+    if (!slab)
+    {
+        return NULL;
+    }
+
+    slab->bin = bin;
+    slab->slot_size = bin->slot_size;
+    slab->capacity = bin->slab_capacity;
+    slab->size = size;
+    slab->used = (uint64_t *)(slab + 1);
+    slab->marks = slab->used + bitmap_words;
+    slab->typed = slab->marks + bitmap_words;
+    slab->atomic = slab->typed + bitmap_words;
+    slab->cards = GC_GENERATIONAL ? (uint8_t *)(slab->atomic + bitmap_words) : NULL;
+    if (!register_segment(slab))
+    {
+        munmap(slab, slab->mapped_size);
+        return NULL;
+    }
+    link_partial_slab(slab);
+    return slab;
+}
+
+static size_t slab_alloc_slots(segment_t *slab, void **slots, size_t count)
+{
+    size_t taken = 0;
+    size_t words = slab->capacity / 64;
+    size_t word = slab->first_free_word;
+
+    while (taken < count && word < words)
+    {
+        uint64_t free_bits = ~slab->used[word];
+        if (!free_bits)
+        {
+            word++;
+            continue;
+        }
+
+        size_t bit = __builtin_ctzll(free_bits);
+        slab->used[word] |= (1ULL << bit);
+        slots[taken++] = slab->memory + (word * 64 + bit) * slab->slot_size;
+    }
+
+    slab->first_free_word = word;
+    slab->used_count += taken;
+    return taken;
+}
+
+static size_t bin_alloc_slots(bin_t *bin, void **slots, size_t count)
+{
+    size_t taken = 0;
+
+    while (taken < count)
+    {
+        segment_t *slab = bin->partial_slabs;
+#ifdef GC_COLLECT
+        // a pending slab is swept before slots are taken from it, and before a new one is mapped
+        if (slab ? slab->unswept : (slab = next_unswept_slab(bin)) != NULL)
+        {
+            sweep_slab(slab);
+            continue;
+        }
+#endif
+        if (!slab && !(slab = map_slab(bin)))
+        {
+            break;
+        }
+
+        size_t slots_taken = slab_alloc_slots(slab, slots + taken, count - taken);
+        __atomic_fetch_add(&gc_allocated_bytes, slots_taken * slab->slot_size, __ATOMIC_RELAXED);
+        taken += slots_taken;
+        if (slab->used_count == slab->capacity)
+        {
+            unlink_partial_slab(slab);
+        }
+    }
+
+    return taken;
+}
+
+static bool bin_free_slot(segment_t *slab, size_t slot)
+{
+    if (!BITMAP_TEST(slab->used, slot))
+    {
+        return false;
+    }
+
+    BITMAP_CLEAR(slab->used, slot);
+    if (GC_GENERATIONAL)
+    {
+        __atomic_fetch_and(&slab->marks[slot / 64], ~(1ULL << (slot % 64)), __ATOMIC_RELAXED);
+    }
+    if (gc_kinds_used)
+    {
+        __atomic_fetch_and(&slab->typed[slot / 64], ~(1ULL << (slot % 64)), __ATOMIC_RELAXED);
+        __atomic_fetch_and(&slab->atomic[slot / 64], ~(1ULL << (slot % 64)), __ATOMIC_RELAXED);
+    }
+    if (slab->used_count-- == slab->capacity)
+    {
+        link_partial_slab(slab);
+    }
+    if ((slot >> 6) < slab->first_free_word)
+    {
+        slab->first_free_word = slot >> 6;
+    }
+    return true;
+}
+
+static void heap_free_chunk(metadata_t *chunk)
+{
+    // an old mark must not carry over to whatever is allocated here next
+    if (GC_GENERATIONAL)
+    {
+        segment_t *segment = segment_for_ptr(chunk->chunk_ptr);
+        BITMAP_CLEAR(segment->marks, HEAP_MARK_BIT(segment, chunk));
+    }
+
+    if (!DEFERRED_COALESCING)
+    {
+        coalesce_chunk(chunk);
+        return;
+    }
+
+    tlsf_insert(chunk);
+    if (!(++num_of_free_called_on_heap & (FREE_DEFRAG_CUTOFF - 1)))
+    {
+        defragment_heap();
+    }
+}
+
+void heap_free(void *ptr)
+{
+    if (!ptr)
+    {
+        return;
+    }
+
+    segment_t *segment = segment_for_ptr(ptr);
+    if (!segment)
+    {
+        return;
+    }
+
+    if (segment->kind == SEGMENT_SLAB)
+    {
+        // a slot already free in its bin or parked in this thread's cache is ignored, like any unknown pointer
+        size_t slot;
+        if (slab_slot(segment, ptr, &slot) &&
+            (__atomic_load_n(&segment->used[slot / 64], __ATOMIC_RELAXED) & (1ULL << (slot % 64))) &&
+            !tcache_holds(ptr, segment->bin - bins))
+        {
+            tcache_free(ptr, segment->bin - bins);
+        }
+        return;
+    }
+
+    if (segment->kind == SEGMENT_LARGE)
+    {
+        if (ptr == segment->memory)
+        {
+            pthread_mutex_lock(&heap_lock);
+            large_free(segment);
+            pthread_mutex_unlock(&heap_lock);
+        }
+        return;
+    }
+
+    if (segment->kind != SEGMENT_HEAP)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&heap_lock);
+    metadata_t *chunk = find_allocation(segment, ptr);
+    if (chunk)
+    {
+        heap_free_chunk(chunk);
+    }
+    pthread_mutex_unlock(&heap_lock);
+}
+
+// the size and alignment an allocation was made with tell a heap chunk or a large object apart without a lookup;
+// a slot still needs the page map, since an ALIGN_SAME realloc or a typed trailer may have put it in another
+// class than size and alignment map to. With SIZED_FREE_CHECK a mismatch is reported and freed the slow way
+void heap_free_sized(void *ptr, size_t size, alignment_t alignment)
+{
+    if (!ptr)
+    {
+        return;
+    }
+
+    if (!alignment || ((alignment) & (alignment - 1)) || (alignment > MAX_ALIGNMENT))
+    {
+        alignment = DEFAULT_ALIGNMENT;
+    }
+
+    if (SIZED_FREE_CHECK && !sized_free_matches(ptr, size, alignment))
+    {
+        fprintf(stderr, "heap_free_sized: %p was not allocated with size %zu and alignment %d\n",
+                ptr, size, alignment);
+        heap_free(ptr);
+        return;
+    }
+
+    if (size_class_for(size, alignment) < BIN_COUNT)
+    {
+        heap_free(ptr);
+        return;
+    }
+
+    pthread_mutex_lock(&heap_lock);
+    if (size >= LARGE_OBJECT_THRESHOLD)
+    {
+        large_free((segment_t *)((uint8_t *)ptr - SEGMENT_HEADER_SIZE));
+    }
+    else
+    {
+        heap_free_chunk(((metadata_t **)ptr)[-1]);
+    }
+    pthread_mutex_unlock(&heap_lock);
+}
+
+static bool sized_free_matches(void *ptr, size_t size, alignment_t alignment)
+{
+    segment_t *segment = segment_for_ptr(ptr);
+    if (!segment)
+    {
+        return false;
+    }
 
-        if (padding >= SPLIT_CUTOFF)
+    // the class is picked the way alloc_typed picks it, a typed object's layout word included
+    size_t slot;
+    if (segment->kind == SEGMENT_SLAB)
+    {
+        if (!slab_slot(segment, ptr, &slot))
         {
-            add_into_free_array(chunk->chunk_ptr, chunk->chunk_ptr,
-                                chunk->prev_chunk_ptr, padding, padding,
-                                calculate_alignment(chunk->chunk_ptr));
-            free_array[free_array_size - 1].alloc_type = ALLOC_TYPE_HEAP;
-
-            chunk->chunk_ptr = (uint8_t *)chunk->chunk_ptr + padding;
-            chunk->size -= padding;
-            chunk->prev_chunk_ptr = (uint8_t *)chunk->chunk_ptr - padding;
+            return false;
         }
+        const gc_type_t *type = gc_kinds_used ? slab_slot_type(segment, slot) : NULL;
+        size_t trailer = type && type != &gc_atomic_type ? sizeof(void *) : 0;
+        return segment->bin == &bins[size_class_for(size + trailer, alignment)];
+    }
+    if (size >= LARGE_OBJECT_THRESHOLD)
+    {
+        return segment->kind == SEGMENT_LARGE && ptr == segment->memory && size <= segment->size;
+    }
 
-        size_t remaining = chunk->size - size;
-        if (remaining >= SPLIT_CUTOFF)
-        {
-            void *new_chunk_ptr = (uint8_t *)chunk->chunk_ptr + size;
-            add_into_free_array(new_chunk_ptr, new_chunk_ptr,
-                                chunk->chunk_ptr, remaining, remaining,
-                                calculate_alignment(new_chunk_ptr));
-            free_array[free_array_size - 1].alloc_type = ALLOC_TYPE_HEAP;
-            chunk->size = size;
-        }
+    pthread_mutex_lock(&heap_lock);
+    metadata_t *chunk = segment->kind == SEGMENT_HEAP ? find_allocation(segment, ptr) : NULL;
+    size_t trailer = chunk && chunk->gc_type && chunk->gc_type != &gc_atomic_type ? sizeof(void *) : 0;
+    bool matches = chunk && size <= chunk->usable_size && size_class_for(size + trailer, alignment) == BIN_COUNT;
+    pthread_mutex_unlock(&heap_lock);
+    return matches;
+}
 
-        add_into_alloc_array(chunk->chunk_ptr, data_ptr,
-                             chunk->prev_chunk_ptr, chunk->size,
-                             chunk->size - padding, alignment);
-        alloc_array[alloc_array_size - 1].alloc_type = ALLOC_TYPE_HEAP;
-        remove_from_free_array(best_fit_index);
+// page aligned mappings already satisfy every alignment_t
+static void *large_alloc(size_t size)
+{
+    segment_t *segment = map_segment(SEGMENT_LARGE, sizeof(segment_t), size);
+    if (!segment)
+    {
+        return NULL;
+    }
 
-        return data_ptr;
+    // no collection runs while the lock is held, and once it is released the object must be reachable through
+    // memory rather than the segment header, which the collector does not recognize
+    pthread_mutex_lock(&heap_lock);
+    bool registered = register_segment(segment);
+    void *memory = segment->memory;
+#ifdef GC_COLLECT
+    if (registered)
+    {
+        allocate_black(memory);
     }
+#endif
+    pthread_mutex_unlock(&heap_lock);
 
-    if (*target_free_size == 0)
+    if (!registered)
     {
+        munmap(segment, segment->mapped_size);
         return NULL;
     }
+    __atomic_fetch_add(&gc_allocated_bytes, size, __ATOMIC_RELAXED);
+    return memory;
+}
 
-    metadata_t chunk = target_free_array[0];
+// must be called with heap_lock held
+static void large_free(segment_t *segment)
+{
+    // a running incremental cycle may still have the object queued for scanning, so its sweep unmaps it instead
+    if (gc_marking)
+    {
+        __atomic_store_n(&segment->mark, false, __ATOMIC_RELAXED);
+        return;
+    }
 
-    size_t padding = ((alignment - (size_t)chunk.chunk_ptr) & (alignment - 1));
-    void *data_ptr = (uint8_t *)chunk.chunk_ptr + padding;
+    unregister_segment(segment);
+    munmap(segment, segment->mapped_size);
+}
 
-    size_t aligned_size = size;
-    if (alignment < size)
+// moves the pages with mremap rather than copying them, so the payload may end up at a new address
+static void *large_realloc(segment_t *segment, size_t new_size)
+{
+    size_t header_size = segment->memory - (uint8_t *)segment;
+    size_t mapped_size = ALIGN_UP(header_size + new_size, HEAP_PAGE_SIZE);
+    if (mapped_size == segment->mapped_size)
     {
-        aligned_size = ((size + (size - 1)) / size) * size;
+        return segment->memory;
     }
 
-    uint8_t *bin_start;
-    uint8_t *bin_end;
-    switch (alloc_type)
+    pthread_mutex_lock(&heap_lock);
+    unregister_segment(segment);
+
+#ifdef MREMAP_MAYMOVE
+    segment_t *moved = mremap(segment, segment->mapped_size, mapped_size, MREMAP_MAYMOVE);
+#else
+    segment_t *moved = mmap(NULL, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (moved != MAP_FAILED)
     {
-    case ALLOC_TYPE_BIN_8:
-        bin_start = bin_8;
-        bin_end = bin_8 + (BIN_8_CAPACITY * BIN_8_SIZE);
-        break;
-    case ALLOC_TYPE_BIN_16:
-        bin_start = bin_16;
-        bin_end = bin_16 + (BIN_16_CAPACITY * BIN_16_SIZE);
-        break;
-    case ALLOC_TYPE_BIN_32:
-        bin_start = bin_32;
-        bin_end = bin_32 + (BIN_32_CAPACITY * BIN_32_SIZE);
-        break;
-    default:
-        return NULL;
+        memcpy(moved, segment, header_size + (new_size < segment->size ? new_size : segment->size));
+        munmap(segment, segment->mapped_size);
     }
+#endif
 
-    if ((uint8_t *)data_ptr + aligned_size > bin_end || (uint8_t *)data_ptr < bin_start)
+    if (moved == MAP_FAILED)
     {
+        register_segment(segment);
+        pthread_mutex_unlock(&heap_lock);
         return NULL;
     }
 
-    metadata_t alloc_chunk = {
-        .chunk_ptr = chunk.chunk_ptr,
-        .data_ptr = data_ptr,
-        .prev_chunk_ptr = chunk.prev_chunk_ptr,
-        .size = aligned_size,
-        .usable_size = aligned_size - padding,
-        .current_alignment = alignment,
-        .alloc_type = alloc_type};
-
-    if (!add_into_array(alloc_chunk, target_alloc_array, target_alloc_size, target_capacity))
+    moved->memory = (uint8_t *)moved + header_size;
+    moved->size = mapped_size - header_size;
+    moved->mapped_size = mapped_size;
+    if (!register_segment(moved))
     {
+        pthread_mutex_unlock(&heap_lock);
+        munmap(moved, mapped_size);
         return NULL;
     }
+    pthread_mutex_unlock(&heap_lock);
 
-    remove_from_array(0, target_free_array, target_free_size);
-
-    return data_ptr;
+    return moved->memory;
 }
 
-static void init_bins()
+static void tcache_flush(tcache_t *cache, size_t bin, size_t count)
 {
-    static bool has_run = false;
-    if (has_run)
+    for (size_t i = 0; i < count; i++)
     {
-        return;
+        size_t slot;
+        segment_t *slab = slab_for_ptr(cache->slots[bin][i], &slot);
+        if (slab)
+        {
+            bin_free_slot(slab, slot);
+        }
     }
 
-    has_run = true;
+    cache->count[bin] -= count;
+    memmove(&cache->slots[bin][0], &cache->slots[bin][count], cache->count[bin] * sizeof(void *));
+}
 
-    free_bin_8_size = 0;
-    for (size_t i = 0; i < BIN_8_CAPACITY; i++)
-    {
-        void *chunk_ptr = &bin_8[i * BIN_8_SIZE];
-        metadata_t chunk = {
-            .chunk_ptr = chunk_ptr,
-            .data_ptr = chunk_ptr,
-            .prev_chunk_ptr = i > 0 ? &bin_8[(i - 1) * BIN_8_SIZE] : NULL,
-            .size = BIN_8_SIZE,
-            .usable_size = BIN_8_SIZE,
-            .current_alignment = MAX_ALIGNMENT,
-            .alloc_type = ALLOC_TYPE_BIN_8};
-        add_into_array(chunk, free_bin_8, &free_bin_8_size, BIN_8_CAPACITY);
-    }
+static void tcache_release(void *arg)
+{
+    tcache_t *cache = arg;
 
-    free_bin_16_size = 0;
-    for (size_t i = 0; i < BIN_16_CAPACITY; i++)
+    pthread_mutex_lock(&heap_lock);
+    for (size_t bin = 0; bin < BIN_COUNT; bin++)
     {
-        void *chunk_ptr = &bin_16[i * BIN_16_SIZE];
-        metadata_t chunk = {
-            .chunk_ptr = chunk_ptr,
-            .data_ptr = chunk_ptr,
-            .prev_chunk_ptr = i > 0 ? &bin_16[(i - 1) * BIN_16_SIZE] : NULL,
-            .size = BIN_16_SIZE,
-            .usable_size = BIN_16_SIZE,
-            .current_alignment = MAX_ALIGNMENT,
-            .alloc_type = ALLOC_TYPE_BIN_16};
-        add_into_array(chunk, free_bin_16, &free_bin_16_size, BIN_16_CAPACITY);
+        tcache_flush(cache, bin, cache->count[bin]);
     }
 
-    free_bin_32_size = 0;
-    for (size_t i = 0; i < BIN_32_CAPACITY; i++)
+    for (tcache_t **link = &tcache_list; *link; link = &(*link)->next)
     {
-        void *chunk_ptr = &bin_32[i * BIN_32_SIZE];
-        metadata_t chunk = {
-            .chunk_ptr = chunk_ptr,
-            .data_ptr = chunk_ptr,
-            .prev_chunk_ptr = i > 0 ? &bin_32[(i - 1) * BIN_32_SIZE] : NULL,
-            .size = BIN_32_SIZE,
-            .usable_size = BIN_32_SIZE,
-            .current_alignment = MAX_ALIGNMENT,
-            .alloc_type = ALLOC_TYPE_BIN_32};
-        add_into_array(chunk, free_bin_32, &free_bin_32_size, BIN_32_CAPACITY);
+        if (*link == cache)
+        {
+            *link = cache->next;
+            break;
+        }
     }
+    cache->registered = false;
+    pthread_mutex_unlock(&heap_lock);
 }
 
-void heap_free(void *ptr)
+static void tcache_create_key()
 {
-    if (!ptr)
+    pthread_key_create(&tcache_key, tcache_release);
+}
+
+// must be called with heap_lock held
+static void tcache_register()
+{
+    if (tcache.registered)
     {
         return;
     }
 
-    metadata_t *chunk = NULL;
-    metadata_t *source_alloc_array = NULL;
-    metadata_t *target_free_array = NULL;
-    size_t *source_alloc_size = NULL;
-    size_t *target_free_size = NULL;
-    size_t target_capacity = 0;
-    ssize_t alloc_index = -1;
-
-    uintptr_t heap_start = (uintptr_t)heap;
-    uintptr_t heap_end = heap_start + HEAP_CAPACITY;
-    uintptr_t bin_8_start = (uintptr_t)bin_8;
-    uintptr_t bin_8_end = bin_8_start + BIN_8_CAPACITY * BIN_8_SIZE;
-    uintptr_t bin_16_start = (uintptr_t)bin_16;
-    uintptr_t bin_16_end = (uintptr_t)bin_16 + BIN_16_CAPACITY * BIN_16_SIZE;
-    uintptr_t bin_32_start = (uintptr_t)bin_32;
-    uintptr_t bin_32_end = bin_32_start + BIN_32_SIZE * BIN_32_CAPACITY;
+    pthread_once(&tcache_key_once, tcache_create_key);
+    pthread_setspecific(tcache_key, &tcache);
+    tcache.next = tcache_list;
+    tcache_list = &tcache;
+    tcache.registered = true;
+}
 
-    if ((uintptr_t)ptr >= bin_8_start && (uintptr_t)ptr < bin_8_end)
+static void *tcache_alloc(size_t bin)
+{
+    if (!tcache.count[bin])
     {
-        source_alloc_array = alloc_bin_8;
-        target_free_array = free_bin_8;
-        source_alloc_size = &alloc_bin_8_size;
-        target_free_size = &free_bin_8_size;
-        target_capacity = BIN_8_CAPACITY;
-        alloc_index = search_by_ptr(ptr, alloc_bin_8, alloc_bin_8_size);
+#ifdef GC_COLLECT
+        gc_assist();
+#endif
+        pthread_mutex_lock(&heap_lock);
+        tcache_register();
+        tcache.count[bin] = bin_alloc_slots(&bins[bin], tcache.slots[bin], TCACHE_BATCH);
+        pthread_mutex_unlock(&heap_lock);
+
+        if (!tcache.count[bin])
+        {
+            return NULL;
+        }
     }
-    else if ((uintptr_t)ptr >= bin_16_start && (uintptr_t)ptr < bin_16_end)
+
+    void *slot = tcache.slots[bin][--tcache.count[bin]];
+    *(uintptr_t *)slot = 0; // no longer cached
+#ifdef GC_COLLECT
+    allocate_black(slot);
+#endif
+    return slot;
+}
+
+static void tcache_free(void *ptr, size_t bin)
+{
+    size_t slot;
+    segment_t *slab = GC_GENERATIONAL || gc_kinds_used ? slab_for_ptr(ptr, &slot) : NULL;
+    if (slab)
     {
-        source_alloc_array = alloc_bin_16;
-        target_free_array = free_bin_16;
-        source_alloc_size = &alloc_bin_16_size;
-        target_free_size = &free_bin_16_size;
-        target_capacity = BIN_16_CAPACITY;
-        alloc_index = search_by_ptr(ptr, alloc_bin_16, alloc_bin_16_size);
+        // other threads free into the same mark and kind words without the lock
+        uint64_t mask = ~(1ULL << (slot % 64));
+        if (GC_GENERATIONAL)
+        {
+            __atomic_fetch_and(&slab->marks[slot / 64], mask, __ATOMIC_RELAXED);
+        }
+        if (gc_kinds_used)
+        {
+            __atomic_fetch_and(&slab->typed[slot / 64], mask, __ATOMIC_RELAXED);
+            __atomic_fetch_and(&slab->atomic[slot / 64], mask, __ATOMIC_RELAXED);
+        }
     }
-    else if ((uintptr_t)ptr >= bin_32_start && (uintptr_t)ptr < bin_32_end)
+
+    if (tcache.count[bin] == TCACHE_CAPACITY || !tcache.registered)
     {
-        source_alloc_array = alloc_bin_32;
-        target_free_array = free_bin_32;
-        source_alloc_size = &alloc_bin_32_size;
-        target_free_size = &free_bin_32_size;
-        target_capacity = BIN_32_CAPACITY;
-        alloc_index = search_by_ptr(ptr, alloc_bin_32, alloc_bin_32_size);
+        pthread_mutex_lock(&heap_lock);
+        tcache_register();
+        if (tcache.count[bin] == TCACHE_CAPACITY)
+        {
+            // hand the oldest (coldest) slots back and keep the recently freed ones
+            tcache_flush(&tcache, bin, TCACHE_BATCH);
+        }
+        pthread_mutex_unlock(&heap_lock);
     }
-    else if ((uintptr_t)ptr >= heap_start && (uintptr_t)ptr < heap_end)
+
+    *(uintptr_t *)ptr = tcache_cookie;
+    tcache.slots[bin][tcache.count[bin]++] = ptr;
+}
+
+// the cookie makes the search rare: only a slot cached before, or one whose first word happens to match, pays it
+static bool tcache_holds(void *ptr, size_t bin)
+{
+    if (*(uintptr_t *)ptr != tcache_cookie)
     {
-        alloc_index = search_by_ptr_in_alloc_array(ptr);
+        return false;
     }
-    else
+
+    for (size_t i = 0; i < tcache.count[bin]; i++)
     {
-        return;
+        if (tcache.slots[bin][i] == ptr)
+        {
+            return true;
+        }
     }
+    return false;
+}
+
+// resizes chunk in place to hold size bytes after its padding, taking from a free successor if needed
+static bool resize_chunk(metadata_t *chunk, size_t size)
+{
+    size_t padding = (uint8_t *)chunk->data_ptr - (uint8_t *)chunk->chunk_ptr; // includes the header
+    size = ALIGN_UP(size, ALIGN_8);
 
-    if (source_alloc_array && alloc_index >= 0)
+    if (padding + size > chunk->size)
     {
-        chunk = &source_alloc_array[alloc_index];
-        metadata_t free_chunk = {
-            .chunk_ptr = chunk->chunk_ptr,
-            .data_ptr = chunk->data_ptr,
-            .prev_chunk_ptr = chunk->prev_chunk_ptr,
-            .size = chunk->size,
-            .usable_size = chunk->usable_size,
-            .current_alignment = chunk->current_alignment,
-            .alloc_type = chunk->alloc_type};
+        metadata_t *next = chunk->next_phys;
+        if (!next || !next->is_free || padding + size > chunk->size + next->size)
+        {
+            return false;
+        }
 
-        if (!add_into_array(free_chunk, target_free_array, target_free_size, target_capacity))
+        tlsf_remove(next);
+        chunk->size += next->size;
+        chunk->next_phys = next->next_phys;
+        if (chunk->next_phys)
         {
-            return;
+            chunk->next_phys->prev_phys = chunk;
         }
-        remove_from_array(alloc_index, source_alloc_array, source_alloc_size);
-        return;
+        release_chunk(next);
     }
 
-    if (alloc_index >= 0)
+    // only split if remaining space is above cutoff
+    metadata_t *rest = split_chunk(chunk, padding + size);
+    if (rest)
     {
-        chunk = &alloc_array[alloc_index];
-        add_into_free_array(
-            chunk->chunk_ptr,
-            chunk->data_ptr,
-            chunk->prev_chunk_ptr,
-            chunk->size,
-            chunk->usable_size,
-            chunk->current_alignment);
-        free_array[free_array_size - 1].alloc_type = ALLOC_TYPE_HEAP;
-        remove_from_alloc_array(alloc_index);
-        if (!num_of_free_called_on_heap && (FREE_DEFRAG_CUTOFF - 1))
-        {
-            defragment_heap();
-        }
+        heap_free_chunk(rest);
     }
+    chunk->usable_size = chunk->size - padding;
+#ifdef GC_COLLECT
+    // a grown chunk may have taken in the stale start bits of its neighbour
+    record_chunk_start(chunk);
+#endif
+    return true;
 }
 
 void *heap_realloc(void *ptr, size_t new_size, alignment_t new_alignment)
@@ -880,67 +3427,386 @@ void *heap_realloc(void *ptr, size_t new_size, alignment_t new_alignment)
         return NULL;
     }
 
+    segment_t *segment = segment_for_ptr(ptr);
+    if (!segment || segment->kind == SEGMENT_CHUNK_POOL)
+    {
+        return NULL;
+    }
+
     if (((new_alignment) & (new_alignment - 1)) || (new_alignment > MAX_ALIGNMENT))
     {
         new_alignment = DEFAULT_ALIGNMENT;
     }
 
-    ssize_t ptr_index = search_by_ptr_in_alloc_array(ptr);
-    if (ptr_index < 0)
+    size_t new_bin;
+    size_t old_usable_size;
+    const gc_type_t *type = NULL; // the moved object keeps its layout
+
+    if (segment->kind == SEGMENT_LARGE)
     {
-        return NULL;
+        if (ptr != segment->memory)
+        {
+            return NULL;
+        }
+        if (!new_alignment)
+        {
+            // a copy that leaves the mapping keeps the alignment the mapping gave it
+            new_alignment = calculate_alignment(segment->memory);
+        }
+        // remapping would pull the pages from under a running incremental cycle, which then copies instead
+        if (new_size >= LARGE_OBJECT_THRESHOLD && !__atomic_load_n(&gc_marking, __ATOMIC_ACQUIRE))
+        {
+            return large_realloc(segment, new_size);
+        }
+        old_usable_size = segment->size;
+        type = segment->gc_type;
     }
+    else if (segment->kind == SEGMENT_SLAB)
+    {
+        if (!new_alignment)
+        {
+            // ALIGN_SAME keeps the alignment class of the source bin
+            new_alignment = segment->bin->alignment;
+        }
 
-    metadata_t *chunk = &alloc_array[ptr_index];
+        size_t slot = BIN_SLOT(segment, ptr);
+        size_t trailer = 0;
+        if (gc_kinds_used && (type = slab_slot_type(segment, slot)) && type != &gc_atomic_type)
+        {
+            trailer = sizeof(void *);
+        }
 
-    if (new_size <= chunk->size)
-    {
-        if (new_alignment != chunk->current_alignment)
+        // staying in the same class needs no copy; the slot is already as aligned as the class requires
+        new_bin = size_class_for(new_size + trailer, new_alignment);
+        if (new_bin == (size_t)(segment->bin - bins))
         {
-            void *new_ptr = heap_alloc(new_size, new_alignment);
-            if (!new_ptr)
-            {
-                return NULL;
-            }
+            return ptr;
+        }
+        old_usable_size = segment->slot_size - trailer;
+    }
+    else
+    {
+        pthread_mutex_lock(&heap_lock);
 
-            size_t copy_size = new_size < chunk->usable_size ? new_size : chunk->usable_size;
-            memcpy(new_ptr, ptr, copy_size);
-            heap_free(ptr);
-            return new_ptr;
+        metadata_t *chunk = find_allocation(segment, ptr);
+        if (!chunk)
+        {
+            pthread_mutex_unlock(&heap_lock);
+            return NULL;
         }
 
-        // now if the alignment is same and the size is below
-        size_t remaining = chunk->size - new_size;
+        if (!new_alignment)
+        {
+            new_alignment = chunk->current_alignment;
+        }
 
-        // only split if remaining space is above cutoff
-        if (remaining >= SPLIT_CUTOFF)
+        // sizes a bin or a mapping of their own would serve move there, the rest stay put whenever possible
+        new_bin = size_class_for(new_size, new_alignment);
+        if (new_bin == BIN_COUNT && new_size < LARGE_OBJECT_THRESHOLD && !((uintptr_t)ptr & (new_alignment - 1)) &&
+            resize_chunk(chunk, new_size))
         {
-            void *new_chunk_ptr = (uint8_t *)chunk->chunk_ptr + new_size;
-            add_into_free_array(new_chunk_ptr, new_chunk_ptr,
-                                chunk->chunk_ptr, remaining, remaining,
-                                calculate_alignment(new_chunk_ptr));
-            chunk->size = new_size;
+            // a later ALIGN_SAME must keep what this call asked for
+            chunk->current_alignment = new_alignment;
+            pthread_mutex_unlock(&heap_lock);
+            return ptr;
         }
 
-        return ptr;
+        old_usable_size = chunk->usable_size;
+        type = chunk->gc_type;
+        pthread_mutex_unlock(&heap_lock);
     }
 
-    void *new_ptr = heap_alloc(new_size, new_alignment);
+    void *new_ptr = alloc_typed(new_size, new_alignment, type);
     if (!new_ptr)
     {
         return NULL;
     }
 
-    memcpy(new_ptr, ptr, chunk->usable_size);
+    size_t copied = new_size < old_usable_size ? new_size : old_usable_size;
+    memcpy(new_ptr, ptr, copied);
+#ifdef GC_COLLECT
+    shade_copy(new_ptr, copied, type);
+#endif
     heap_free(ptr);
     return new_ptr;
 }
 
+// fills out with up to n allocations of the same size and alignment, returning how many were served
+size_t heap_alloc_batch(size_t size, alignment_t alignment, void **out, size_t n)
+{
+    if (!size || !out)
+    {
+        return 0;
+    }
+
+    heap_init();
+
+    if (!alignment || ((alignment) & (alignment - 1)) || (alignment > MAX_ALIGNMENT))
+    {
+        alignment = DEFAULT_ALIGNMENT;
+    }
+
+    size_t served = 0;
+    size_t bin = size_class_for(size, alignment);
+
+    if (bin < BIN_COUNT)
+    {
+        // drain this thread's cache first, then take the rest straight from the bin in one locked pass
+        while (served < n && tcache.count[bin])
+        {
+            out[served] = tcache.slots[bin][--tcache.count[bin]];
+            *(uintptr_t *)out[served++] = 0;
+        }
+
+        if (served < n)
+        {
+            pthread_mutex_lock(&heap_lock);
+            served += bin_alloc_slots(&bins[bin], out + served, n - served);
+            pthread_mutex_unlock(&heap_lock);
+        }
+#ifdef GC_COLLECT
+        for (size_t i = 0; i < served; i++)
+        {
+            allocate_black(out[i]);
+        }
+#endif
+        return served;
+    }
+
+    if (size >= LARGE_OBJECT_THRESHOLD)
+    {
+        while (served < n && (out[served] = large_alloc(size)))
+        {
+            served++;
+        }
+        return served;
+    }
+
+    pthread_mutex_lock(&heap_lock);
+    while (served < n && (out[served] = heap_alloc_chunk(size, alignment)))
+    {
+        served++;
+    }
+    pthread_mutex_unlock(&heap_lock);
+
+    return served;
+}
+
+// frees every pointer in ptrs under a single lock, bypassing the thread cache, and returns how many were freed
+size_t heap_free_batch(void **ptrs, size_t n)
+{
+    size_t freed = 0;
+
+    pthread_mutex_lock(&heap_lock);
+    for (size_t i = 0; i < n; i++)
+    {
+        segment_t *segment = ptrs[i] ? segment_for_ptr(ptrs[i]) : NULL;
+        if (!segment)
+        {
+            continue;
+        }
+
+        size_t slot;
+        metadata_t *chunk;
+
+        if (segment->kind == SEGMENT_SLAB)
+        {
+            freed += slab_slot(segment, ptrs[i], &slot) && bin_free_slot(segment, slot);
+        }
+        else if (segment->kind == SEGMENT_HEAP && (chunk = find_allocation(segment, ptrs[i])))
+        {
+            heap_free_chunk(chunk);
+            freed++;
+        }
+        else if (segment->kind == SEGMENT_LARGE && ptrs[i] == segment->memory)
+        {
+            large_free(segment);
+            freed++;
+        }
+    }
+    pthread_mutex_unlock(&heap_lock);
+
+    return freed;
+}
+
+void heap_get_stats(size_t *total_size, size_t *used_size,
+                    size_t *free_size, size_t *largest_free_block)
+{
+    *total_size = *used_size = *free_size = *largest_free_block = 0;
+
+    pthread_mutex_lock(&heap_lock);
+    for (segment_t *segment = segment_list; segment; segment = segment->next)
+    {
+        if (segment->kind == SEGMENT_HEAP)
+        {
+            for (metadata_t *chunk = segment->first_chunk; chunk; chunk = chunk->next_phys)
+            {
+                if (chunk->is_free)
+                {
+                    *free_size += chunk->size;
+                    *largest_free_block = chunk->size > *largest_free_block ? chunk->size : *largest_free_block;
+                }
+                else
+                {
+                    *used_size += chunk->size;
+                }
+            }
+            *total_size += segment->size;
+        }
+        else if (segment->kind == SEGMENT_SLAB)
+        {
+            // slots parked in thread caches count as used
+            *used_size += segment->used_count * segment->slot_size;
+            *free_size += (segment->capacity - segment->used_count) * segment->slot_size;
+            *total_size += segment->capacity * segment->slot_size;
+        }
+        else if (segment->kind == SEGMENT_LARGE)
+        {
+            *used_size += segment->size;
+            *total_size += segment->size;
+        }
+    }
+    pthread_mutex_unlock(&heap_lock);
+}
+
+heap_arena_t *heap_arena_create(size_t chunk_size)
+{
+    heap_arena_t *arena = heap_alloc(sizeof(heap_arena_t), ALIGN_DEFAULT);
+    if (!arena)
+    {
+        return NULL;
+    }
+
+    arena->head = arena->current = NULL;
+    arena->chunk_size = chunk_size ? chunk_size : ARENA_CHUNK_SIZE;
+
+    pthread_mutex_lock(&heap_lock);
+    arena->prev = NULL;
+    arena->next = arena_list;
+    if (arena_list)
+    {
+        arena_list->prev = arena;
+    }
+    arena_list = arena;
+    pthread_mutex_unlock(&heap_lock);
+
+    return arena;
+}
+
+// links a fresh chunk able to hold size bytes in right after the current one and makes it current
+static arena_chunk_t *arena_add_chunk(heap_arena_t *arena, size_t size)
+{
+    size_t capacity = size > arena->chunk_size ? size : arena->chunk_size;
+    arena_chunk_t *chunk = heap_alloc(ARENA_CHUNK_HEADER_SIZE + capacity, MAX_ALIGNMENT);
+    if (!chunk)
+    {
+        return NULL;
+    }
+
+    chunk->top = ARENA_CHUNK_DATA(chunk);
+    chunk->end = chunk->top + capacity;
+    if (arena->current)
+    {
+        chunk->next = arena->current->next;
+        arena->current->next = chunk;
+    }
+    else
+    {
+        chunk->next = arena->head;
+        arena->head = chunk;
+    }
+    arena->current = chunk;
+    return chunk;
+}
+
+void *heap_arena_alloc(heap_arena_t *arena, size_t size, alignment_t alignment)
+{
+    if (!arena || !size)
+    {
+        return NULL;
+    }
+
+    if (!alignment || ((alignment) & (alignment - 1)) || (alignment > MAX_ALIGNMENT))
+    {
+        alignment = DEFAULT_ALIGNMENT;
+    }
+
+    arena_chunk_t *chunk = arena->current;
+    uint8_t *ptr = chunk ? (uint8_t *)ALIGN_UP((uintptr_t)chunk->top, alignment) : NULL;
+
+    while (!chunk || ptr + size > chunk->end)
+    {
+        // reuse chunks kept from before a reset, as long as they are large enough
+        arena_chunk_t *next = chunk ? chunk->next : arena->head;
+        if (next && ARENA_CHUNK_DATA(next) + size <= next->end)
+        {
+            next->top = ARENA_CHUNK_DATA(next);
+            arena->current = chunk = next;
+        }
+        else if (!(chunk = arena_add_chunk(arena, size)))
+        {
+            return NULL;
+        }
+        ptr = chunk->top; // chunk data is MAX_ALIGNMENT aligned
+    }
+
+    chunk->top = ptr + size;
+    return ptr;
+}
+
+// forgets every allocation at once; the chunks are kept and refilled from the first
+void heap_arena_reset(heap_arena_t *arena)
+{
+    if (arena && arena->head)
+    {
+        arena->head->top = ARENA_CHUNK_DATA(arena->head);
+        arena->current = arena->head;
+    }
+}
+
+void heap_arena_destroy(heap_arena_t *arena)
+{
+    if (!arena)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&heap_lock);
+    if (arena->prev)
+    {
+        arena->prev->next = arena->next;
+    }
+    else
+    {
+        arena_list = arena->next;
+    }
+    if (arena->next)
+    {
+        arena->next->prev = arena->prev;
+    }
+    pthread_mutex_unlock(&heap_lock);
+
+    for (arena_chunk_t *chunk = arena->head, *next; chunk; chunk = next)
+    {
+        next = chunk->next;
+        heap_free(chunk);
+    }
+    heap_free(arena);
+}
+
 #endif // MEM_IMPLEMENTATION
 
-#undef HEAP_CAPACITY
-#undef FREE_CAPACITY
-#undef ALLOC_CAPACITY
+#undef HEAP_SEGMENT_SIZE
+#undef LARGE_OBJECT_THRESHOLD
+#undef ARENA_CHUNK_SIZE
+#undef HEAP_PAGE_SHIFT
+#undef HEAP_PAGE_SIZE
+#undef CHUNK_POOL_GROWTH
+#undef CHUNK_HEADER_SIZE
+
+#undef PAGE_MAP_ADDRESS_BITS
+#undef PAGE_MAP_LEAF_BITS
+#undef PAGE_MAP_ROOT_BITS
 
 #undef MAX_ALIGNMENT
 #undef MAX_ALIGNMENT_INT
@@ -948,13 +3814,44 @@ void *heap_realloc(void *ptr, size_t new_size, alignment_t new_alignment)
 
 #undef SPLIT_CUTOFF
 
+#undef DEFERRED_COALESCING
 #undef FREE_DEFRAG_CUTOFF // must be a power of 2
-
-#undef BIN_8_SIZE
-#undef BIN_16_SIZE
-#undef BIN_32_SIZE
-#undef BIN_8_CAPACITY
-#undef BIN_16_CAPACITY
-#undef BIN_32_CAPACITY
+#undef SIZED_FREE_CHECK
+
+#undef TLSF_SL_LOG2
+#undef TLSF_SL_COUNT
+#undef TLSF_GRANULE_LOG2
+#undef TLSF_FL_SHIFT
+#undef TLSF_SMALL_BLOCK
+#undef TLSF_FL_MAX
+#undef TLSF_FL_COUNT
+
+#undef SIZE_CLASSES
+#undef SIZE_CLASS_MAX
+#undef SIZE_CLASS_ONE
+#undef SIZE_CLASS_INVALID
+#undef SIZE_CLASS_BIN
+#undef SIZE_CLASS_ALIGNMENT
+
+#undef BIN_COUNT
+#undef TCACHE_CAPACITY
+#undef TCACHE_BATCH
+
+#undef GC_LAZY_SWEEP
+#undef GC_GENERATIONAL
+#undef GC_FULL_INTERVAL
+#undef GC_CONCURRENT
+#undef GC_CONCURRENT_SLICE
+#undef GC_CONCURRENT_HEADROOM
+#undef GC_CARD_SHIFT
+#undef GC_MARK_THREADS
+#undef GC_DEQUE_CAPACITY
+#undef GC_MARK_CHUNK
+#undef GC_ASSIST_WORK
+#undef GC_PACING_RATIO
+#undef GC_PACING_MIN
+#undef GC_INTERIOR_POINTERS
+#undef GC_SUSPEND_SIGNAL
+#undef GC_RESUME_SIGNAL
 
 #endif /* D46AFE7A_7823_4C7A_A759_A5737B4A74D1 */
@@ -1,6 +1,20 @@
 #include <stdio.h>
 #include "mem_alloc.h"
 #include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+
+static int failures = 0;
+
+#define CHECK(condition)                                                        \
+    do                                                                          \
+    {                                                                           \
+        if (!(condition))                                                       \
+        {                                                                       \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            failures++;                                                         \
+        }                                                                       \
+    } while (0)
 
 typedef struct Node
 {
@@ -42,9 +56,299 @@ void print_list(Node *head)
     printf("\n");
 }
 
+// a heap block resized in place keeps the alignment it was resized with for a later ALIGN_SAME
+void check_realloc_in_place_alignment()
+{
+    void *blocks[64];
+    for (int i = 0; i < 64; i++)
+    {
+        blocks[i] = heap_alloc(5000 + i * 24, ALIGN_8);
+        if ((uintptr_t)blocks[i] & (ALIGN_16 - 1))
+        {
+            continue;
+        }
+
+        // shrinking a heap block never has to move it
+        CHECK(heap_realloc(blocks[i], 4200, ALIGN_16) == blocks[i]);
+        blocks[i] = heap_realloc(blocks[i], 8, ALIGN_SAME);
+        CHECK(!((uintptr_t)blocks[i] & (ALIGN_16 - 1)));
+    }
+
+    for (int i = 0; i < 64; i++)
+    {
+        heap_free(blocks[i]);
+    }
+}
+
+// freeing a slot twice must not let two allocations share it
+void check_double_free()
+{
+    void *slot = heap_alloc(48, ALIGN_DEFAULT);
+    heap_free(slot);
+    heap_free(slot);
+
+    void *first = heap_alloc(48, ALIGN_DEFAULT);
+    void *second = heap_alloc(48, ALIGN_DEFAULT);
+    CHECK(first != second);
+    heap_free(first);
+    heap_free(second);
+}
+
+static void fill(unsigned char *block, size_t size, unsigned char seed)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        block[i] = (unsigned char)(seed + i * 7);
+    }
+}
+
+static int holds(const unsigned char *block, size_t size, unsigned char seed)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        if (block[i] != (unsigned char)(seed + i * 7))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static size_t used_bytes()
+{
+    size_t total, used, free, largest;
+    heap_get_stats(&total, &used, &free, &largest);
+    return used;
+}
+
+// a block moved between size class slots, heap chunks and large objects keeps its contents, and ALIGN_SAME keeps
+// the alignment it was last given
+void check_realloc_across_kinds()
+{
+    static const size_t sizes[] = {24, 3000, 10000, 300000, 100, 40, 500000, 16};
+    static const alignment_t alignments[] = {ALIGN_32, ALIGN_SAME, ALIGN_64, ALIGN_SAME, ALIGN_SAME, ALIGN_16, ALIGN_SAME, ALIGN_SAME};
+
+    size_t size = 8;
+    alignment_t alignment = ALIGN_8;
+    unsigned char *block = heap_alloc(size, alignment);
+    fill(block, size, 1);
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        unsigned char *moved = heap_realloc(block, sizes[i], alignments[i]);
+        CHECK(moved != NULL);
+        if (!moved)
+        {
+            break;
+        }
+
+        alignment = alignments[i] == ALIGN_SAME ? alignment : alignments[i];
+        CHECK(!((uintptr_t)moved & (alignment - 1)));
+        CHECK(holds(moved, sizes[i] < size ? sizes[i] : size, 1));
+
+        fill(moved, sizes[i], 1);
+        block = moved;
+        size = sizes[i];
+    }
+
+    heap_free(block);
+}
+
+// batches hand out distinct aligned blocks and take them all back; a sized free releases each kind of block
+void check_sized_and_batch_free()
+{
+    void *batch[100];
+    size_t count = heap_alloc_batch(64, ALIGN_16, batch, 100);
+    CHECK(count == 100);
+    for (size_t i = 0; i < count; i++)
+    {
+        CHECK(!((uintptr_t)batch[i] & (ALIGN_16 - 1)));
+        fill(batch[i], 64, (unsigned char)i);
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        CHECK(holds(batch[i], 64, (unsigned char)i));
+    }
+    CHECK(heap_free_batch(batch, count) == count);
+
+    // the slot goes back to this thread's cache, which hands it out next
+    void *slot = heap_alloc(40, ALIGN_8);
+    heap_free_sized(slot, 40, ALIGN_8);
+    void *again = heap_alloc(40, ALIGN_8);
+    CHECK(again == slot);
+    heap_free(again);
+
+    static const size_t sizes[] = {5000, 400000};
+    static const alignment_t alignments[] = {ALIGN_32, ALIGN_64};
+    for (size_t i = 0; i < 2; i++)
+    {
+        void *block = heap_alloc(sizes[i], alignments[i]);
+        size_t before = used_bytes();
+        heap_free_sized(block, sizes[i], alignments[i]);
+        CHECK(used_bytes() + sizes[i] <= before);
+    }
+}
+
+// an arena hands out aligned, disjoint memory, starts over after a reset and gives its chunks back when destroyed
+void check_arena()
+{
+    size_t before = used_bytes();
+    heap_arena_t *arena = heap_arena_create(64 * 1024);
+    CHECK(arena != NULL);
+
+    unsigned char *blocks[400];
+    for (size_t i = 0; i < 400; i++)
+    {
+        blocks[i] = heap_arena_alloc(arena, 1000 + i % 50, ALIGN_16);
+        CHECK(!((uintptr_t)blocks[i] & (ALIGN_16 - 1)));
+        fill(blocks[i], 1000 + i % 50, (unsigned char)i);
+    }
+    for (size_t i = 0; i < 400; i++)
+    {
+        CHECK(holds(blocks[i], 1000 + i % 50, (unsigned char)i));
+    }
+    CHECK(used_bytes() >= before + 4 * 64 * 1024);
+
+    heap_arena_reset(arena);
+    CHECK(heap_arena_alloc(arena, 1000, ALIGN_16) == blocks[0]);
+
+    heap_arena_destroy(arena);
+    CHECK(used_bytes() < before + 64 * 1024);
+}
+
+typedef struct Pair
+{
+    unsigned char *left;
+    uintptr_t key; // not a pointer field, so an address kept here does not keep its block alive
+    unsigned char *right;
+} Pair;
+
+static const uint64_t pair_pointers = GC_POINTER_BIT(Pair, left) | GC_POINTER_BIT(Pair, right);
+static const gc_type_t pair_type = {sizeof(Pair), &pair_pointers};
+
+static Pair *typed_pairs = NULL;
+static uintptr_t *atomic_words = NULL;
+
+// typed objects keep only what their pointer fields reach and atomic objects keep nothing alive
+void check_typed_and_atomic()
+{
+    gc_collect_full();
+
+    typed_pairs = gc_alloc_typed(16 * sizeof(Pair), ALIGN_DEFAULT, &pair_type);
+    atomic_words = gc_alloc_atomic(16 * sizeof(uintptr_t), ALIGN_DEFAULT);
+    for (size_t i = 0; i < 16; i++)
+    {
+        unsigned char *kept = heap_alloc(20000, ALIGN_DEFAULT);
+        fill(kept, 20000, (unsigned char)i);
+        gc_write_barrier(&typed_pairs[i].left, kept);
+        gc_write_barrier(&typed_pairs[i].right, NULL);
+        typed_pairs[i].key = (uintptr_t)heap_alloc(20000, ALIGN_DEFAULT);
+        atomic_words[i] = (uintptr_t)heap_alloc(20000, ALIGN_DEFAULT);
+    }
+
+    // the 32 blocks only keys and atomic words refer to go; stale stack words may keep a few of them
+    size_t before = used_bytes();
+    gc_collect_full();
+    CHECK(used_bytes() + 16 * 20000 <= before);
+
+    for (size_t i = 0; i < 16; i++)
+    {
+        CHECK(holds(typed_pairs[i].left, 20000, (unsigned char)i));
+    }
+
+    typed_pairs = NULL;
+    atomic_words = NULL;
+}
+
+#define GC_KINDS 3
+static const size_t gc_sizes[GC_KINDS] = {48, 20000, 300000}; // a slot, a heap chunk and a large object
+static const size_t gc_counts[GC_KINDS] = {256, 64, 8};
+static uintptr_t hidden[GC_KINDS][256];         // each object's address with its bits flipped, which no scan sees
+static void *volatile interior[GC_KINDS][256]; // the only pointers to the objects: into the middle or at the last byte
+
+// gc_collect only wakes the collector thread with GC_CONCURRENT, so reclamation can take a moment to show
+static size_t collect_until(void (*collect)(), size_t limit)
+{
+    collect();
+    size_t used = used_bytes();
+    for (int i = 0; i < 500 && used > limit; i++)
+    {
+        usleep(10000);
+        used = used_bytes();
+    }
+    return used;
+}
+
+static void collect_incrementally()
+{
+    while (gc_step(64 * 1024))
+    {
+    }
+}
+
+// objects reachable only through interior pointers survive a collection, then go with the interior pointers, as
+// does the garbage around them
+void check_gc_interior(void (*collect)())
+{
+    // no collection may start on its own before the garbage is counted
+    size_t pacing = gc_set_pacing(0);
+    size_t garbage = 0;
+    for (size_t kind = 0; kind < GC_KINDS; kind++)
+    {
+        for (size_t i = 0; i < gc_counts[kind]; i++)
+        {
+            unsigned char *object = heap_alloc(gc_sizes[kind], ALIGN_DEFAULT);
+            fill(object, gc_sizes[kind], (unsigned char)(kind + i));
+            hidden[kind][i] = ~(uintptr_t)object;
+            interior[kind][i] = i % 2 ? object + gc_sizes[kind] / 2 : object + gc_sizes[kind] - 1;
+
+            heap_alloc(gc_sizes[kind], ALIGN_DEFAULT);
+            garbage += gc_sizes[kind];
+        }
+    }
+
+    size_t live = used_bytes();
+    CHECK(collect_until(collect, live - garbage / 2) <= live - garbage / 2);
+
+    // memory the collector wrongly freed gets handed out and overwritten here
+    for (size_t kind = 0; kind < GC_KINDS; kind++)
+    {
+        for (size_t i = 0; i < gc_counts[kind]; i++)
+        {
+            unsigned char *block = heap_alloc(gc_sizes[kind], ALIGN_DEFAULT);
+            memset(block, 0, gc_sizes[kind]);
+            heap_free(block);
+        }
+    }
+
+    for (size_t kind = 0; kind < GC_KINDS; kind++)
+    {
+        for (size_t i = 0; i < gc_counts[kind]; i++)
+        {
+            CHECK(holds((unsigned char *)~hidden[kind][i], gc_sizes[kind], (unsigned char)(kind + i)));
+        }
+    }
+
+    live = used_bytes();
+    memset((void *)interior, 0, sizeof(interior));
+    CHECK(collect_until(collect, live - garbage / 2) <= live - garbage / 2);
+
+    gc_set_pacing(pacing);
+}
+
 int main()
 {
     heap_init();
+    check_realloc_in_place_alignment();
+    check_double_free();
+    check_realloc_across_kinds();
+    check_sized_and_batch_free();
+    check_arena();
+    check_typed_and_atomic();
+    check_gc_interior(gc_collect_full);
+    check_gc_interior(collect_incrementally);
+    check_gc_interior(gc_collect); // concurrent when built with -DGC_CONCURRENT=1
+
     global_list = create_mixed_list();
     gc_register_root(global_list);
 
@@ -69,5 +373,6 @@ int main()
     printf("\nFinal list state:\n");
     print_list(global_list);
 
-    return 0;
+    printf("\n%d checks failed\n", failures);
+    return failures ? 1 : 0;
 }
\ No newline at end of file